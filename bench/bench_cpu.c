@@ -0,0 +1,197 @@
+/*****  CPU COST PER GIGABYTE BENCHMARK   *****/
+
+/* Downloads <File> <transfers> times from the server, one connection each, and reports how much CPU the server
+   process <pid> (and the children it forks meanwhile) has used per GB sent: CPU cycles if the hardware counter can
+   be read with perf_event_open(), CPU time from /proc/<pid>/stat in any case.
+   Run it once against each build of the server to compare send paths (sendfile(), copy loop, MSG_ZEROCOPY).
+   Note that on the loopback interface MSG_ZEROCOPY falls back to a copy, use two hosts to measure it.
+
+   Usage: ./bench_cpu [-n transfers] -P <server pid> <IP Addr> <Port> <File> */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "../errlib.h"
+#include "../sockwrap.h"
+
+/* CONSTANTS */
+
+#define BUFLEN 128                                                          /* Request buffer length */
+#define MAXBUFLEN (1024*1024)                                               /* Receiver buffer length */
+#define GB 1e9
+
+/* GLOBAL VARIABLES */
+
+char    *prog_name;
+char    ackMsg[5] = "+OK\r\n";
+
+
+double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Cycles counter of the process and of its future children, -1 if not available (no PMU, perf_event_paranoid) */
+int openCyclesCounter(pid_t pid)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size           = sizeof(attr);
+    attr.type           = PERF_TYPE_HARDWARE;
+    attr.config         = PERF_COUNT_HW_CPU_CYCLES;
+    attr.inherit        = 1;                                                /* server2 forks a child per connection */
+    attr.exclude_hv     = 1;
+
+    return syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+}
+
+/* User and system CPU time of the process and of its terminated children, in seconds */
+double cpuTime(pid_t pid)
+{
+    char    path[64], buf[1024], *p;
+    unsigned long long utime, stime, cutime, cstime;
+    int     fd;
+    ssize_t n;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    if((fd = open(path, O_RDONLY)) == -1)
+        err_sys("(%s) error - can not open %s", prog_name, path);
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if(n <= 0)
+        err_quit("(%s) error - can not read %s", prog_name, path);
+    buf[n] = '\0';
+
+    if((p = strrchr(buf, ')')) == NULL ||                                   /* The command name may contain spaces */
+       sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %llu %llu", &utime, &stime, &cutime, &cstime) != 4)
+        err_quit("(%s) error - unexpected format of %s", prog_name, path);
+
+    return (double)(utime + stime + cutime + cstime) / sysconf(_SC_CLK_TCK);
+}
+
+/* Sends one GET and reads the whole response. Returns the content size, -1 on error */
+long long download(struct sockaddr_in *saddr, char *msg, char *rbuf)
+{
+    uint32_t fileSize;
+    long long left;
+    ssize_t n;
+    int     s;
+
+    s = Socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if(connect(s, (struct sockaddr *) saddr, sizeof(*saddr)) != 0)
+    {
+        close(s);
+        return -1;
+    }
+
+    if(writen(s, msg, strlen(msg)) != strlen(msg) ||
+       readn(s, rbuf, sizeof(ackMsg)) != sizeof(ackMsg) || memcmp(rbuf, ackMsg, sizeof(ackMsg)) != 0 ||
+       readn(s, &fileSize, sizeof(uint32_t)) != sizeof(uint32_t))
+    {
+        close(s);
+        return -1;
+    }
+
+    left = ntohl(fileSize) + sizeof(uint32_t);                              /* Content and last modification date */
+
+    while(left > 0)
+    {
+        n = recv(s, rbuf, left < MAXBUFLEN ? left : MAXBUFLEN, 0);
+
+        if(n <= 0)
+        {
+            close(s);
+            return -1;
+        }
+
+        left -= n;
+    }
+
+    close(s);
+    return ntohl(fileSize);
+}
+
+int main(int argc, char *argv[])
+{
+    struct  sockaddr_in saddr;
+    uint16_t port;
+    char    msg[BUFLEN];
+    char    *rbuf;
+    int     transfers = 10;
+    pid_t   pid = 0;
+    int     counter;
+    int     opt;
+    long long size, bytes = 0;
+    uint64_t cyclesStart = 0, cyclesEnd = 0;
+    double  cpuStart, start, seconds, cpu;
+
+    prog_name = argv[0];
+
+    while((opt = getopt(argc, argv, "n:P:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'n': transfers = atoi(optarg); break;
+            case 'P': pid       = atoi(optarg); break;
+            default:
+                err_quit("Usage: %s [-n transfers] -P <server pid> <IP Addr> <Port> <File>", prog_name);
+        }
+    }
+
+    if(argc - optind != 3 || transfers < 1 || pid <= 0)
+        err_quit("Usage: %s [-n transfers] -P <server pid> <IP Addr> <Port> <File>", prog_name);
+
+    bzero(&saddr, sizeof(saddr));
+    saddr.sin_family = AF_INET;
+    Inet_aton(argv[optind], &saddr.sin_addr);
+    if(sscanf(argv[optind + 1], "%" SCNu16, &port) != 1)
+        err_quit("Invalid port number");
+    saddr.sin_port = htons(port);
+
+    snprintf(msg, BUFLEN, "GET %s\r\n", argv[optind + 2]);
+
+    Signal(SIGPIPE, SIG_IGN);
+
+    rbuf = malloc(MAXBUFLEN);
+
+    if((counter = openCyclesCounter(pid)) == -1)
+        fprintf(stderr, "(%s) cycles counter not available (%s), reporting CPU time only\n", prog_name, strerror(errno));
+    else if(read(counter, &cyclesStart, sizeof(cyclesStart)) != sizeof(cyclesStart))
+        err_sys("(%s) error - can not read the cycles counter", prog_name);
+
+    cpuStart = cpuTime(pid);
+    start    = now();
+
+    for(int i = 0; i < transfers; i++)
+    {
+        if((size = download(&saddr, msg, rbuf)) < 0)
+            err_quit("(%s) error - transfer %d failed", prog_name, i + 1);
+        bytes += size;
+    }
+
+    usleep(100000);                                                         /* Let sigchldHandler() of server2 reap the last child, so that its CPU time is counted */
+
+    seconds = now() - start;
+    cpu     = cpuTime(pid) - cpuStart;
+
+    printf("transfers=%d bytes=%lld seconds=%.2f GB/s=%.3f server-cpu-sec/GB=%.4f",
+           transfers, bytes, seconds, bytes / GB / seconds, cpu / (bytes / GB));
+
+    if(counter != -1 && read(counter, &cyclesEnd, sizeof(cyclesEnd)) == sizeof(cyclesEnd))
+        printf(" server-cycles/GB=%.0f", (cyclesEnd - cyclesStart) / (bytes / GB));
+
+    printf("\n");
+
+    free(rbuf);
+    return 0;
+}
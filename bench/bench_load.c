@@ -0,0 +1,692 @@
+/*****  LOAD BENCHMARK   *****/
+
+/* Starts a server on the loopback interface in a directory filled with a generated corpus of files, drives it with
+   <clients> concurrent processes for <seconds> seconds and prints one JSON object with the throughput (MB/s,
+   requests/s) and the latency of the responses (p50, p99, p999 and max, from the request to the last byte,
+   connection included).
+
+   The server is any program taking the port number as its last argument and serving the files of its working
+   directory, e.g. ../server1/server1_main or "../server2/server2_main -p 4": it is started in its own process group
+   and killed at the end. Results of several servers can be appended to one file and compared side by side:
+
+       for s in server1 server2 server3 server4; do ./bench_load -c 8 -D loguniform:1k:100m -w corpus ../$s/${s}_main >> results.json; done
+
+   File sizes are drawn from a distribution (the same for a given seed):
+       fixed:<size>              all files have the same size
+       uniform:<min>:<max>       any size between min and max, equally likely
+       loguniform:<min>:<max>    every order of magnitude between min and max equally likely (default 1k:1m)
+   Sizes take the suffixes k, m and g (1024 multiples), from 1 byte to 10g. With -w the corpus is kept in <dir> and
+   files that already have the right size are not written again; otherwise it is created in /tmp and removed.
+   -S creates sparse files (no disk space, the content is all zeros). Clients request files at random with
+   "GET", speaking protocol version 2 if the corpus has a file of 4 GiB or more, or if asked with -v 2.
+
+   -L <clients>:<size> mixes in a class of clients downloading one big file over and over, to see how much the
+   responses of the others are delayed by it (head-of-line blocking, e.g. server3 with -F drr or -F srpt). Their
+   results are reported apart, under "large"; the other fields are then those of the -c clients only.
+
+   Usage: ./bench_load [-c clients] [-d seconds] [-k] [-n files] [-D distribution] [-r seed] [-w dir] [-S] [-v version]
+                       [-L clients:size] [-l label] [-V] <server program> [server options] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include "../errlib.h"
+#include "../sockwrap.h"
+#include "../protocol.h"
+
+/* CONSTANTS */
+
+#define BUFLEN 512                                                          /* Request buffer length */
+#define MAXBUFLEN (1024*1024)                                               /* Receiver buffer length, also the block written to the corpus files */
+#define MAXFILESIZE (10LL*1024*1024*1024)
+#define LATENCY_BUCKETS 29800                                               /* 1 us buckets up to 10 ms, 100 us up to 1 s, 10 ms up to 100 s */
+#define STARTUP_TIMEOUT 5                                                   /* Seconds the server has to accept connections */
+#define RECEIVE_TIMEOUT 30                                                  /* server1 serves one client at a time, do not block forever */
+
+/* TYPES */
+
+struct clientResult                                                         /* One per client, shared with the parent */
+{
+    long    requests;
+    long    errors;
+    long long bytes;
+    long    histogram[LATENCY_BUCKETS];
+};
+
+/* GLOBAL VARIABLES */
+
+char    *prog_name;
+char    ackMsg[5] = "+OK\r\n";
+pid_t   serverPid = 0;
+char    corpusDir[256];
+int     removeCorpus = 0;
+int     fileCount = 100;
+int     corpusFiles;                                                        /* fileCount, plus the big file of -L */
+off_t   *fileSizes;
+
+
+double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void usage(void)
+{
+    err_quit("Usage: %s [-c clients] [-d seconds] [-k] [-n files] [-D distribution] [-r seed] [-w dir] [-S] [-v version] [-L clients:size] [-l label] [-V] <server program> [server options]", prog_name);
+}
+
+/* "10", "4k", "1m", "10g". Returns -1 if the size is not valid */
+off_t parseSize(const char *s)
+{
+    char    *end;
+    long long n;
+
+    errno = 0;
+    n = strtoll(s, &end, 10);
+    if(errno != 0 || end == s || n < 0)
+        return -1;
+
+    switch(*end)
+    {
+        case 'k': case 'K': n *= 1024;                  end++; break;
+        case 'm': case 'M': n *= 1024 * 1024;           end++; break;
+        case 'g': case 'G': n *= 1024LL * 1024 * 1024;  end++; break;
+    }
+
+    return (*end == '\0' && n <= MAXFILESIZE) ? n : -1;
+}
+
+/* Sizes of the corpus drawn from the distribution. Returns 0 on success */
+int drawSizes(const char *distribution, unsigned seed)
+{
+    char    spec[64], *kind, *a, *b;
+    off_t   min, max;
+    double  u;
+
+    snprintf(spec, sizeof(spec), "%s", distribution);
+    kind = strtok(spec, ":");
+    a    = strtok(NULL, ":");
+    b    = strtok(NULL, ":");
+
+    if(kind == NULL || a == NULL || (min = parseSize(a)) < 0)
+        return 1;
+
+    if(strcmp(kind, "fixed") == 0 && b == NULL)
+        max = min;
+    else if((strcmp(kind, "uniform") == 0 || strcmp(kind, "loguniform") == 0) && b != NULL && (max = parseSize(b)) >= min)
+        ;
+    else
+        return 1;
+
+    if(strcmp(kind, "loguniform") == 0 && min == 0)
+        min = 1;
+
+    for(int i = 0; i < fileCount; i++)
+    {
+        u = rand_r(&seed) / (RAND_MAX + 1.0);
+
+        if(strcmp(kind, "loguniform") == 0)
+            fileSizes[i] = exp(log(min) + u * (log(max) - log(min)));
+        else
+            fileSizes[i] = min + u * (max - min);
+    }
+
+    return 0;
+}
+
+void fileName(char *buf, size_t len, int i)
+{
+    snprintf(buf, len, "bench%04d.bin", i);
+}
+
+/* Writes the files whose size differs from the wanted one, a pseudo-random block repeated */
+void createCorpus(int sparse, unsigned seed)
+{
+    char    name[32], path[BUFLEN];
+    char    *block;
+    struct  stat st;
+    struct  statvfs vfs;
+    long long needed = 0;
+    off_t   left;
+    ssize_t n;
+    int     fd;
+
+    for(int i = 0; i < corpusFiles; i++)
+    {
+        fileName(name, sizeof(name), i);
+        snprintf(path, sizeof(path), "%s/%s", corpusDir, name);
+        if(stat(path, &st) != 0 || st.st_size != fileSizes[i])
+            needed += fileSizes[i];
+    }
+
+    if(needed == 0)
+        return;
+
+    if(sparse == 0 && statvfs(corpusDir, &vfs) == 0 && needed > (long long)vfs.f_bavail * vfs.f_frsize)
+        err_quit("(%s) error - the corpus needs %lld MB in %s, only %lld MB are free (use -S for sparse files)", prog_name,
+                 needed >> 20, corpusDir, ((long long)vfs.f_bavail * vfs.f_frsize) >> 20);
+
+    fprintf(stderr, "(%s) writing %.1f MB of corpus in %s\n", prog_name, needed / 1048576.0, corpusDir);
+
+    block = malloc(MAXBUFLEN);
+    for(int i = 0; i < MAXBUFLEN; i++)
+        block[i] = rand_r(&seed);
+
+    for(int i = 0; i < corpusFiles; i++)
+    {
+        fileName(name, sizeof(name), i);
+        snprintf(path, sizeof(path), "%s/%s", corpusDir, name);
+        if(stat(path, &st) == 0 && st.st_size == fileSizes[i])
+            continue;
+
+        if((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+            err_sys("(%s) error - can not create %s", prog_name, path);
+
+        if(sparse)
+        {
+            if(ftruncate(fd, fileSizes[i]) != 0)
+                err_sys("(%s) error - can not extend %s", prog_name, path);
+        }
+        else
+        {
+            for(left = fileSizes[i]; left > 0; left -= n)
+                if((n = write(fd, block, left < MAXBUFLEN ? left : MAXBUFLEN)) <= 0)
+                    err_sys("(%s) error - can not write %s", prog_name, path);
+        }
+
+        close(fd);
+    }
+
+    free(block);
+}
+
+void removeCorpusFiles(void)
+{
+    char    name[32], path[BUFLEN];
+
+    for(int i = 0; i < corpusFiles; i++)
+    {
+        fileName(name, sizeof(name), i);
+        snprintf(path, sizeof(path), "%s/%s", corpusDir, name);
+        unlink(path);
+    }
+    rmdir(corpusDir);
+}
+
+/* Kills the server and all the processes it has forked, also when the benchmark quits on an error */
+void stopServer(void)
+{
+    if(serverPid > 0)
+    {
+        kill(-serverPid, SIGTERM);
+        waitpid(serverPid, NULL, 0);
+        serverPid = 0;
+    }
+
+    if(removeCorpus)
+    {
+        removeCorpusFiles();
+        removeCorpus = 0;
+    }
+}
+
+/* A port nobody listens on now */
+uint16_t freePort(void)
+{
+    struct  sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int     s;
+
+    bzero(&addr, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    s = Socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    Bind(s, (struct sockaddr *) &addr, sizeof(addr));
+    if(getsockname(s, (struct sockaddr *) &addr, &len) != 0)
+        err_sys("(%s) error - getsockname() failed", prog_name);
+    close(s);
+
+    return ntohs(addr.sin_port);
+}
+
+int connectServer(struct sockaddr_in *saddr)
+{
+    struct  timeval tval = {RECEIVE_TIMEOUT, 0};
+    int     s;
+
+    if((s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+        return -1;
+
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tval, sizeof(tval));
+
+    if(connect(s, (struct sockaddr *) saddr, sizeof(*saddr)) != 0)
+    {
+        close(s);
+        return -1;
+    }
+
+    return s;
+}
+
+/* Runs the server in the corpus directory with the port as last argument and waits until it accepts connections */
+void startServer(char **command, int commandLen, uint16_t port, int verbose, struct sockaddr_in *saddr)
+{
+    char    portArg[8];
+    char    **args;
+    double  deadline;
+    int     s, fd;
+
+    snprintf(portArg, sizeof(portArg), "%u", port);
+
+    args = calloc(commandLen + 2, sizeof(char *));
+    memcpy(args, command, commandLen * sizeof(char *));
+    args[commandLen] = portArg;
+
+    if((serverPid = Fork()) == 0)
+    {
+        removeCorpus = 0;                                                   /* Only the parent cleans up */
+        setpgid(0, 0);                                                      /* server2 children are killed with it */
+
+        if(chdir(corpusDir) != 0)
+            err_sys("(%s) error - can not enter %s", prog_name, corpusDir);
+
+        if(verbose == 0 && (fd = open("/dev/null", O_WRONLY)) != -1)
+        {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+        }
+
+        execvp(args[0], args);
+        err_sys("(%s) error - can not run %s", prog_name, args[0]);
+    }
+
+    setpgid(serverPid, serverPid);                                          /* Also here, the child may not have run yet when it is killed */
+    free(args);
+
+    deadline = now() + STARTUP_TIMEOUT;
+    while((s = connectServer(saddr)) == -1)
+    {
+        if(waitpid(serverPid, NULL, WNOHANG) == serverPid)
+        {
+            serverPid = 0;
+            err_quit("(%s) error - %s has exited (run with -V to see its output)", prog_name, command[0]);
+        }
+        if(now() > deadline)
+            err_quit("(%s) error - %s does not accept connections on port %u", prog_name, command[0], port);
+        usleep(10000);
+    }
+    close(s);
+}
+
+/* Asks for version 2, returns the version spoken on the connection (1 if the server does not know VERS) */
+int negotiate(int *s, struct sockaddr_in *saddr, char *rbuf)
+{
+    uint32_t chosen;
+    char    msg[] = "VERS 2\r\n";
+
+    if(writen(*s, msg, strlen(msg)) != strlen(msg) || readn(*s, rbuf, sizeof(ackMsg)) != sizeof(ackMsg))
+        return -1;
+
+    if(memcmp(rbuf, ackMsg, sizeof(ackMsg)) != 0)                           /* "-ERR": the server has closed the connection */
+    {
+        close(*s);
+        return (*s = connectServer(saddr)) == -1 ? -1 : PROTO_V1;
+    }
+
+    if(readn(*s, &chosen, sizeof(chosen)) != sizeof(chosen))
+        return -1;
+
+    return ntohl(chosen);
+}
+
+/* Sends one GET and reads the whole response. Returns the content size, -1 on error */
+long long request(int s, int version, char *msg, char *rbuf)
+{
+    uint32_t size32;
+    uint64_t size64;
+    long long size, left;
+    ssize_t n;
+
+    if(writen(s, msg, strlen(msg)) != strlen(msg))
+        return -1;
+
+    if(readn(s, rbuf, sizeof(ackMsg)) != sizeof(ackMsg) || memcmp(rbuf, ackMsg, sizeof(ackMsg)) != 0)
+        return -1;
+
+    if(version == PROTO_V1)
+    {
+        if(readn(s, &size32, sizeof(size32)) != sizeof(size32))
+            return -1;
+        size = ntohl(size32);
+        left = size + 4;                                                    /* Content and last modification date */
+    }
+    else
+    {
+        if(readn(s, &size64, sizeof(size64)) != sizeof(size64))
+            return -1;
+        size = be64toh(size64);
+        left = size + 8;
+    }
+
+    while(left > 0)
+    {
+        n = recv(s, rbuf, left < MAXBUFLEN ? left : MAXBUFLEN, 0);
+
+        if(n <= 0)
+            return -1;
+
+        left -= n;
+    }
+
+    return size;
+}
+
+int latencyBucket(double seconds)
+{
+    long    us = seconds * 1e6;
+
+    if(us < 10000)
+        return us;
+    if(us < 1000000)
+        return 10000 + (us - 10000) / 100;
+    if(us < 100000000)
+        return 19900 + (us - 1000000) / 10000;
+    return LATENCY_BUCKETS - 1;
+}
+
+/* Upper bound of the latency of the bucket, in microseconds */
+long bucketLatency(int bucket)
+{
+    if(bucket < 10000)
+        return bucket + 1;
+    if(bucket < 19900)
+        return 10000 + (bucket - 10000 + 1) * 100;
+    return 1000000 + (bucket - 19900 + 1) * 10000L;
+}
+
+/* Latency (us) not exceeded by the fraction p of the responses */
+long percentile(long *histogram, long total, double p)
+{
+    long    seen = 0;
+
+    if(total == 0)
+        return 0;
+
+    for(int i = 0; i < LATENCY_BUCKETS; i++)
+        if((seen += histogram[i]) >= p * total)
+            return bucketLatency(i);
+    return 0;
+}
+
+long maxLatency(long *histogram)
+{
+    for(int i = LATENCY_BUCKETS - 1; i >= 0; i--)
+        if(histogram[i] != 0)
+            return bucketLatency(i);
+    return 0;
+}
+
+/* Requests files at random, or always the file only if it is not -1 */
+void runClient(struct sockaddr_in *saddr, double deadline, int keepAlive, int wantedVersion, unsigned seed, int only, struct clientResult *result)
+{
+    char    *rbuf = malloc(MAXBUFLEN);
+    char    msg[BUFLEN], name[32];
+    long long size;
+    int     s = -1, version = PROTO_V1, i;
+    double  t;
+
+    while((t = now()) < deadline)
+    {
+        i = only != -1 ? only : rand_r(&seed) % fileCount;
+        fileName(name, sizeof(name), i);
+        snprintf(msg, sizeof(msg), "GET %s\r\n", name);
+
+        if(s == -1)
+        {
+            if((s = connectServer(saddr)) == -1)
+            {
+                result->errors++;
+                continue;
+            }
+            if(wantedVersion == PROTO_V2 && (version = negotiate(&s, saddr, rbuf)) != PROTO_V2)
+            {
+                if(s != -1)
+                    close(s);
+                s = -1;
+                result->errors++;
+                continue;
+            }
+        }
+
+        if((size = request(s, version, msg, rbuf)) == fileSizes[i])
+        {
+            result->requests++;
+            result->bytes += size;
+            result->histogram[latencyBucket(now() - t)]++;
+        }
+        else
+        {
+            result->errors++;
+            close(s);
+            s = -1;
+            continue;
+        }
+
+        if(keepAlive == 0)
+        {
+            close(s);
+            s = -1;
+        }
+    }
+
+    if(s != -1)
+        close(s);
+
+    free(rbuf);
+}
+
+void printJsonString(const char *s)
+{
+    putchar('"');
+    for(; *s; s++)
+    {
+        if(*s == '"' || *s == '\\')
+            printf("\\%c", *s);
+        else if((unsigned char)*s < 0x20)
+            printf("\\u%04x", *s);
+        else
+            putchar(*s);
+    }
+    putchar('"');
+}
+
+int main(int argc, char *argv[])
+{
+    struct  sockaddr_in saddr;
+    struct  clientResult *results;
+    pid_t   *pids;
+    char    *distribution = "loguniform:1k:1m";
+    char    *label = NULL;
+    char    command[BUFLEN] = "";
+    int     clients = 1;
+    int     largeClients = 0;
+    off_t   largeSize = 0;
+    char    *colon;
+    int     seconds = 10;
+    int     keepAlive = 0;
+    int     sparse = 0;
+    int     verbose = 0;
+    int     version = 0;
+    unsigned seed = 1;
+    int     opt;
+    uint16_t port;
+    long    requests = 0, errors = 0, largeRequests = 0, largeErrors = 0;
+    long long bytes = 0, largeBytes = 0, corpusBytes = 0;
+    double  start, deadline, elapsed;
+
+    prog_name = argv[0];
+
+    while((opt = getopt(argc, argv, "+c:d:kn:D:r:w:Sv:L:l:V")) != -1)           /* Options after the server program are its own */
+    {
+        switch(opt)
+        {
+            case 'c': clients      = atoi(optarg);  break;
+            case 'd': seconds      = atoi(optarg);  break;
+            case 'k': keepAlive    = 1;             break;
+            case 'n': fileCount    = atoi(optarg);  break;
+            case 'D': distribution = optarg;        break;
+            case 'r': seed         = atoi(optarg);  break;
+            case 'w': snprintf(corpusDir, sizeof(corpusDir), "%s", optarg); break;
+            case 'S': sparse       = 1;             break;
+            case 'v': version      = atoi(optarg);  break;
+            case 'L':
+                largeClients = atoi(optarg);
+                if(largeClients < 1 || (colon = strchr(optarg, ':')) == NULL || (largeSize = parseSize(colon + 1)) < 0)
+                    usage();
+                break;
+            case 'l': label        = optarg;        break;
+            case 'V': verbose      = 1;             break;
+            default:
+                usage();
+        }
+    }
+
+    if(argc - optind < 1 || clients < 1 || seconds < 1 || fileCount < 1 || (version != 0 && version != PROTO_V1 && version != PROTO_V2))
+        usage();
+
+    corpusFiles = fileCount + (largeClients > 0);
+    fileSizes = malloc(corpusFiles * sizeof(off_t));
+    if(drawSizes(distribution, seed) != 0)
+        err_quit("(%s) error - invalid distribution %s (fixed:<size>, uniform:<min>:<max> or loguniform:<min>:<max>, up to 10g)", prog_name, distribution);
+    if(largeClients > 0)
+        fileSizes[fileCount] = largeSize;                                   /* The last file of the corpus */
+
+    for(int i = 0; i < corpusFiles; i++)
+    {
+        corpusBytes += fileSizes[i];
+        if(fileSizes[i] > UINT32_MAX)
+        {
+            if(version == PROTO_V1)
+                err_quit("(%s) error - the corpus has files of 4 GiB or more, they need -v 2", prog_name);
+            version = PROTO_V2;
+        }
+    }
+    if(version == 0)
+        version = PROTO_V1;
+
+    for(int i = optind; i < argc; i++)
+        snprintf(command + strlen(command), sizeof(command) - strlen(command), "%s%s", i > optind ? " " : "", argv[i]);
+
+    if(corpusDir[0] == '\0')
+    {
+        snprintf(corpusDir, sizeof(corpusDir), "/tmp/bench_corpus.XXXXXX");
+        if(mkdtemp(corpusDir) == NULL)
+            err_sys("(%s) error - can not create the corpus directory", prog_name);
+        removeCorpus = 1;
+    }
+    else if(mkdir(corpusDir, 0755) != 0 && errno != EEXIST)
+        err_sys("(%s) error - can not create %s", prog_name, corpusDir);
+
+    atexit(stopServer);
+    Signal(SIGPIPE, SIG_IGN);
+
+    createCorpus(sparse, seed);
+
+    port = freePort();
+    bzero(&saddr, sizeof(saddr));
+    saddr.sin_family      = AF_INET;
+    saddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    saddr.sin_port        = htons(port);
+
+    startServer(argv + optind, argc - optind, port, verbose, &saddr);
+
+    results = mmap(NULL, (clients + largeClients) * sizeof(struct clientResult), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(results == MAP_FAILED)
+        err_sys("(%s) error - mmap() failed", prog_name);
+
+    start    = now();
+    deadline = start + seconds;
+
+    pids = malloc((clients + largeClients) * sizeof(pid_t));
+
+    for(int i = 0; i < clients + largeClients; i++)                         /* The -L clients come after the others */
+    {
+        if((pids[i] = Fork()) == 0)
+        {
+            serverPid    = 0;                                               /* The parent stops it */
+            removeCorpus = 0;
+            runClient(&saddr, deadline, keepAlive, version, seed * 7919 + i, i < clients ? -1 : fileCount, &results[i]);
+            exit(EXIT_SUCCESS);
+        }
+    }
+
+    for(int i = 0; i < clients + largeClients; i++)                         /* Not wait(), the server is a child too */
+        while(waitpid(pids[i], NULL, 0) == -1 && errno == EINTR)
+            ;
+
+    elapsed = now() - start;                                                /* Responses started before the deadline are waited for */
+
+    for(int i = 0; i < clients; i++)
+    {
+        requests += results[i].requests;
+        errors   += results[i].errors;
+        bytes    += results[i].bytes;
+
+        if(i > 0)                                                           /* Merged into the first one */
+            for(int j = 0; j < LATENCY_BUCKETS; j++)
+                results[0].histogram[j] += results[i].histogram[j];
+    }
+
+    for(int i = clients; i < clients + largeClients; i++)
+    {
+        largeRequests += results[i].requests;
+        largeErrors   += results[i].errors;
+        largeBytes    += results[i].bytes;
+
+        if(i > clients)                                                     /* Merged into the first large one */
+            for(int j = 0; j < LATENCY_BUCKETS; j++)
+                results[clients].histogram[j] += results[i].histogram[j];
+    }
+
+    stopServer();
+
+    printf("{\"label\":");
+    printJsonString(label != NULL ? label : command);
+    printf(",\"server\":");
+    printJsonString(command);
+    printf(",\"clients\":%d,\"keepalive\":%s,\"protocol\":%d,\"seconds\":%.3f,", clients, keepAlive ? "true" : "false", version, elapsed);
+    printf("\"corpus\":{\"files\":%d,\"bytes\":%lld,\"distribution\":", fileCount, corpusBytes);
+    printJsonString(distribution);
+    printf(",\"seed\":%u,\"sparse\":%s},", seed, sparse ? "true" : "false");
+    printf("\"requests\":%ld,\"errors\":%ld,\"bytes\":%lld,\"mb_per_sec\":%.2f,\"requests_per_sec\":%.1f,",
+           requests, errors, bytes, bytes / 1e6 / elapsed, requests / elapsed);
+    printf("\"latency_us\":{\"p50\":%ld,\"p99\":%ld,\"p999\":%ld,\"max\":%ld}",
+           percentile(results[0].histogram, requests, 0.50), percentile(results[0].histogram, requests, 0.99),
+           percentile(results[0].histogram, requests, 0.999), maxLatency(results[0].histogram));
+    if(largeClients > 0)
+    {
+        printf(",\"large\":{\"clients\":%d,\"size\":%lld,\"requests\":%ld,\"errors\":%ld,\"bytes\":%lld,\"mb_per_sec\":%.2f,",
+               largeClients, (long long)largeSize, largeRequests, largeErrors, largeBytes, largeBytes / 1e6 / elapsed);
+        printf("\"latency_us\":{\"p50\":%ld,\"p99\":%ld,\"max\":%ld}}",
+               percentile(results[clients].histogram, largeRequests, 0.50), percentile(results[clients].histogram, largeRequests, 0.99),
+               maxLatency(results[clients].histogram));
+    }
+    printf("}\n");
+
+    return 0;
+}
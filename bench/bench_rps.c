@@ -0,0 +1,236 @@
+/*****  REQUESTS PER SECOND BENCHMARK   *****/
+
+/* Forks <clients> processes that request the same (small) file from the server again and again for
+   <seconds> seconds and reports how many whole responses have been received per second.
+   By default every request uses a new connection, with -k one connection is kept for all requests.
+   The latency of each response (from the request to the last byte, connection included) is reported as p50/p99.
+
+   Usage: ./bench_rps [-c clients] [-d seconds] [-k] <IP Addr> <Port> <File> */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include "../errlib.h"
+#include "../sockwrap.h"
+
+/* CONSTANTS */
+
+#define BUFLEN 128                                                          /* Request buffer length */
+#define MAXBUFLEN 65536                                                     /* Receiver buffer length */
+#define LATENCY_BUCKETS 11000                                               /* 1 us buckets up to 10 ms, then 1 ms buckets up to 1 s */
+
+/* GLOBAL VARIABLES */
+
+char    *prog_name;
+char    ackMsg[5] = "+OK\r\n";
+
+
+double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int connectServer(struct sockaddr_in *saddr)
+{
+    struct  timeval tval = {1, 0};                                          /* server1 serves one client at a time, do not block forever */
+    int     s;
+
+    if((s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+        return -1;
+
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tval, sizeof(tval));
+
+    if(connect(s, (struct sockaddr *) saddr, sizeof(*saddr)) != 0)
+    {
+        close(s);
+        return -1;
+    }
+
+    return s;
+}
+
+/* Sends one GET and reads the whole response. Returns 0 on success */
+int request(int s, char *msg, char *rbuf)
+{
+    uint32_t fileSize;
+    long    left;
+    ssize_t n;
+
+    if(writen(s, msg, strlen(msg)) != strlen(msg))
+        return 1;
+
+    if(readn(s, rbuf, sizeof(ackMsg)) != sizeof(ackMsg) || memcmp(rbuf, ackMsg, sizeof(ackMsg)) != 0)
+        return 1;
+
+    if(readn(s, &fileSize, sizeof(uint32_t)) != sizeof(uint32_t))
+        return 1;
+
+    left = ntohl(fileSize) + sizeof(uint32_t);                              /* Content and last modification date */
+
+    while(left > 0)
+    {
+        n = recv(s, rbuf, left < MAXBUFLEN ? left : MAXBUFLEN, 0);
+
+        if(n <= 0)
+            return 1;
+
+        left -= n;
+    }
+
+    return 0;
+}
+
+int latencyBucket(double seconds)
+{
+    long    us = seconds * 1e6;
+
+    if(us < 10000)
+        return us;
+    return (us / 1000 - 10 < LATENCY_BUCKETS - 10000 - 1) ? 10000 + us / 1000 - 10 : LATENCY_BUCKETS - 1;
+}
+
+/* Upper bound of the latency of the bucket, in microseconds */
+long bucketLatency(int bucket)
+{
+    return bucket < 10000 ? bucket + 1 : (bucket - 10000 + 11) * 1000;
+}
+
+/* Latency (us) not exceeded by the fraction p of the responses */
+long percentile(long *histogram, long total, double p)
+{
+    long    seen = 0;
+
+    for(int i = 0; i < LATENCY_BUCKETS; i++)
+        if((seen += histogram[i]) >= p * total)
+            return bucketLatency(i);
+    return 0;
+}
+
+long runClient(struct sockaddr_in *saddr, char *msg, double deadline, int keepAlive, long *histogram)
+{
+    char    *rbuf = malloc(MAXBUFLEN);
+    long    count = 0;
+    int     s = -1;
+    double  t;
+
+    while((t = now()) < deadline)
+    {
+        if(s == -1 && (s = connectServer(saddr)) == -1)
+            continue;
+
+        if(request(s, msg, rbuf) == 0)
+        {
+            count++;
+            histogram[latencyBucket(now() - t)]++;
+        }
+        else
+        {
+            close(s);
+            s = -1;
+            continue;
+        }
+
+        if(keepAlive == 0)
+        {
+            close(s);
+            s = -1;
+        }
+    }
+
+    if(s != -1)
+        close(s);
+
+    free(rbuf);
+    return count;
+}
+
+int main(int argc, char *argv[])
+{
+    struct  sockaddr_in saddr;
+    uint16_t port;
+    char    msg[BUFLEN];
+    int     clients = 1;
+    int     seconds = 5;
+    int     keepAlive = 0;
+    int     pfd[2];
+    int     opt;
+    long    count, total = 0;
+    long    *histograms;                                                    /* One per client, shared with the parent */
+    double  start, deadline;
+
+    prog_name = argv[0];
+
+    while((opt = getopt(argc, argv, "c:d:k")) != -1)
+    {
+        switch(opt)
+        {
+            case 'c': clients   = atoi(optarg); break;
+            case 'd': seconds   = atoi(optarg); break;
+            case 'k': keepAlive = 1;            break;
+            default:
+                err_quit("Usage: %s [-c clients] [-d seconds] [-k] <IP Addr> <Port> <File>", prog_name);
+        }
+    }
+
+    if(argc - optind != 3 || clients < 1 || seconds < 1)
+        err_quit("Usage: %s [-c clients] [-d seconds] [-k] <IP Addr> <Port> <File>", prog_name);
+
+    bzero(&saddr, sizeof(saddr));
+    saddr.sin_family = AF_INET;
+    Inet_aton(argv[optind], &saddr.sin_addr);
+    if(sscanf(argv[optind + 1], "%" SCNu16, &port) != 1)
+        err_quit("Invalid port number");
+    saddr.sin_port = htons(port);
+
+    snprintf(msg, BUFLEN, "GET %s\r\n", argv[optind + 2]);
+
+    Signal(SIGPIPE, SIG_IGN);
+
+    if(pipe(pfd) == -1)
+        err_sys("(%s) error - pipe() failed", prog_name);
+
+    histograms = mmap(NULL, clients * LATENCY_BUCKETS * sizeof(long), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(histograms == MAP_FAILED)
+        err_sys("(%s) error - mmap() failed", prog_name);
+
+    start    = now();
+    deadline = start + seconds;
+
+    for(int i = 0; i < clients; i++)
+    {
+        if(Fork() == 0)
+        {
+            count = runClient(&saddr, msg, deadline, keepAlive, histograms + i * LATENCY_BUCKETS);
+            Writen(pfd[1], &count, sizeof(count));
+            exit(EXIT_SUCCESS);
+        }
+    }
+
+    for(int i = 0; i < clients; i++)
+    {
+        if(Readn(pfd[0], &count, sizeof(count)) == sizeof(count))
+            total += count;
+    }
+
+    while(wait(NULL) > 0)
+        ;
+
+    for(int i = 1; i < clients; i++)                                        /* Merged into the first one */
+        for(int j = 0; j < LATENCY_BUCKETS; j++)
+            histograms[j] += histograms[i * LATENCY_BUCKETS + j];
+
+    printf("clients=%d keepalive=%d requests=%ld seconds=%.2f requests/sec=%.1f p50_us=%ld p99_us=%ld\n",
+           clients, keepAlive, total, now() - start, total / (now() - start),
+           percentile(histograms, total, 0.50), percentile(histograms, total, 0.99));
+
+    return 0;
+}
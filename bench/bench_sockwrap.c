@@ -0,0 +1,239 @@
+/*****  SOCKWRAP MICROBENCHMARK   *****/
+
+/* Moves data through a pipe or a socketpair with the I/O functions of sockwrap.c, for several buffer (or line)
+   sizes, and reports the time per byte and the system calls per byte on each side:
+
+       writen  -> readn                 pipe and socketpair, buffers of 1 byte to 1 MB
+       sendn   -> readn                 socketpair
+       writen  -> readline              pipe and socketpair, lines of 16 to 1000 bytes (sent in 64 KB blocks)
+       writen  -> readline_unbuffered   socketpair (one recv() per byte)
+
+   The writer is a child process, the reader is this process. System calls are counted by the read(), write(),
+   recv() and send() defined below, which take the place of the libc ones for sockwrap.c and make the same system
+   calls. Each case moves <MB> megabytes, or less when that would take more than a million system calls.
+   One line per case, in the key=value form of the other benchmarks, so that runs can be kept and compared.
+
+   Usage: ./bench_sockwrap [-m MB] [-f filter] (only the cases whose function name contains filter) */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "../errlib.h"
+#include "../sockwrap.h"
+
+/* CONSTANTS */
+
+#define MAXBUFLEN (1024*1024)                                               /* Biggest buffer size */
+#define LINEBLOCK 65536                                                     /* The writer of the readline cases sends this many bytes of lines at a time */
+#define MAXLINELEN 4096                                                     /* maxlen given to readline() */
+#define MAXSYSCALLS (1024*1024)                                             /* Per side and case */
+
+#define PIPE       0
+#define SOCKETPAIR 1
+
+/* GLOBAL VARIABLES */
+
+char    *prog_name;
+long    syscalls;                                                           /* Of this process, reset by each side of each case */
+
+size_t  bufferSizes[] = {1, 16, 64, 256, 1024, 4096, 16384, 65536, 262144, MAXBUFLEN, 0};
+size_t  lineLengths[] = {16, 64, 256, 1000, 0};
+
+
+/* The system calls used by sockwrap.c, counted */
+
+ssize_t read(int fd, void *buf, size_t n)
+{
+    syscalls++;
+    return syscall(SYS_read, fd, buf, n);
+}
+
+ssize_t write(int fd, const void *buf, size_t n)
+{
+    syscalls++;
+    return syscall(SYS_write, fd, buf, n);
+}
+
+ssize_t recv(int fd, void *buf, size_t n, int flags)
+{
+    syscalls++;
+    return syscall(SYS_recvfrom, fd, buf, n, flags, NULL, NULL);
+}
+
+ssize_t send(int fd, const void *buf, size_t n, int flags)
+{
+    syscalls++;
+    return syscall(SYS_sendto, fd, buf, n, flags, NULL, 0);
+}
+
+double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Writer side: bytes in buffers of size bytes with writen() or sendn(), or lines of size bytes with writen() */
+void writer(int fd, const char *function, size_t size, long long bytes, char *buf)
+{
+    size_t  len;
+
+    if(strcmp(function, "readline") == 0 || strcmp(function, "readline_unbuffered") == 0)
+    {
+        for(size_t i = 0; i < LINEBLOCK; i++)
+            buf[i] = (i % size == size - 1) ? '\n' : 'x';
+
+        for(len = LINEBLOCK / size * size; bytes > 0; bytes -= len)
+        {
+            if(len > bytes)
+                len = bytes;
+            if(writen(fd, buf, len) != len)
+                err_sys("(%s) error - writen() failed", prog_name);
+        }
+        return;
+    }
+
+    memset(buf, 'x', size);
+
+    for(; bytes > 0; bytes -= size)
+    {
+        if(strcmp(function, "sendn") == 0)
+        {
+            if(sendn(fd, buf, size, 0) != size)
+                err_sys("(%s) error - sendn() failed", prog_name);
+        }
+        else if(writen(fd, buf, size) != size)
+            err_sys("(%s) error - writen() failed", prog_name);
+    }
+}
+
+/* Reader side, until EOF. Returns the bytes received */
+long long reader(int fd, const char *function, size_t size, char *buf)
+{
+    long long total = 0;
+    ssize_t n;
+
+    for(;;)
+    {
+        if(strcmp(function, "readline") == 0)
+            n = readline(fd, buf, MAXLINELEN);
+        else if(strcmp(function, "readline_unbuffered") == 0)
+            n = readline_unbuffered(fd, buf, MAXLINELEN);
+        else
+            n = readn(fd, buf, size);
+
+        if(n < 0)
+            err_sys("(%s) error - %s() failed", prog_name, function);
+        if(n == 0)
+            return total;
+
+        if(strncmp(function, "readline", 8) == 0)
+            total += strlen(buf);                                           /* Not n, one more than the length when EOF ends the line */
+        else
+            total += n;
+    }
+}
+
+void runCase(const char *writeFunction, const char *readFunction, int channel, size_t size, long long maxBytes, long *writerSyscalls, char *buf)
+{
+    int     fds[2];
+    long long bytes, received;
+    size_t  unit;
+    pid_t   pid;
+    double  start, elapsed;
+
+    unit  = strcmp(readFunction, "readline_unbuffered") == 0 ? 1 : size;     /* Bytes per system call at best */
+    bytes = maxBytes < (long long)unit * MAXSYSCALLS ? maxBytes : (long long)unit * MAXSYSCALLS;
+    bytes = bytes / size * size;
+
+    if(channel == PIPE ? pipe(fds) != 0 : socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+        err_sys("(%s) error - can not create the channel", prog_name);
+
+    start = now();
+
+    if((pid = Fork()) == 0)
+    {
+        close(fds[0]);
+        syscalls = 0;
+        writer(fds[1], strcmp(readFunction, "readn") == 0 ? writeFunction : readFunction, size, bytes, buf);
+        *writerSyscalls = syscalls;
+        exit(EXIT_SUCCESS);
+    }
+
+    close(fds[1]);
+    syscalls = 0;
+    received = reader(fds[0], readFunction, size, buf);
+    elapsed = now() - start;
+
+    close(fds[0]);
+    waitpid(pid, NULL, 0);
+
+    if(received != bytes)
+        err_quit("(%s) error - %s() received %lld bytes instead of %lld", prog_name, readFunction, received, bytes);
+
+    printf("write=%s read=%s channel=%s size=%zu bytes=%lld ns/byte=%.3f writer-syscalls/byte=%.6f reader-syscalls/byte=%.6f\n",
+           writeFunction, readFunction, channel == PIPE ? "pipe" : "socketpair", size, bytes,
+           elapsed * 1e9 / bytes, (double)*writerSyscalls / bytes, (double)syscalls / bytes);
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    char    *filter = "";
+    char    *buf;
+    long    *writerSyscalls;                                                /* Shared with the writer */
+    long long maxBytes = 64LL * 1024 * 1024;
+    int     opt;
+
+    prog_name = argv[0];
+
+    while((opt = getopt(argc, argv, "m:f:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'm': maxBytes = atoll(optarg) * 1024 * 1024; break;
+            case 'f': filter   = optarg;                      break;
+            default:
+                err_quit("Usage: %s [-m MB] [-f filter]", prog_name);
+        }
+    }
+
+    if(argc != optind || maxBytes <= 0)
+        err_quit("Usage: %s [-m MB] [-f filter]", prog_name);
+
+    Signal(SIGPIPE, SIG_IGN);
+
+    writerSyscalls = mmap(NULL, sizeof(long), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(writerSyscalls == MAP_FAILED)
+        err_sys("(%s) error - mmap() failed", prog_name);
+
+    if((buf = malloc(MAXBUFLEN)) == NULL)
+        err_sys("(%s) error - malloc() failed", prog_name);
+
+    for(int channel = PIPE; channel <= SOCKETPAIR; channel++)
+        for(int i = 0; bufferSizes[i] != 0; i++)
+            if(strstr("writen readn", filter) != NULL)
+                runCase("writen", "readn", channel, bufferSizes[i], maxBytes, writerSyscalls, buf);
+
+    for(int i = 0; bufferSizes[i] != 0; i++)
+        if(strstr("sendn readn", filter) != NULL)
+            runCase("sendn", "readn", SOCKETPAIR, bufferSizes[i], maxBytes, writerSyscalls, buf);
+
+    for(int channel = PIPE; channel <= SOCKETPAIR; channel++)
+        for(int i = 0; lineLengths[i] != 0; i++)
+            if(strstr("writen readline", filter) != NULL)
+                runCase("writen", "readline", channel, lineLengths[i], maxBytes, writerSyscalls, buf);
+
+    for(int i = 0; lineLengths[i] != 0; i++)
+        if(strstr("writen readline_unbuffered", filter) != NULL)
+            runCase("writen", "readline_unbuffered", SOCKETPAIR, lineLengths[i], maxBytes, writerSyscalls, buf);
+
+    free(buf);
+    return 0;
+}
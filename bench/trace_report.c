@@ -0,0 +1,270 @@
+/*****  TRACE REPORT   *****/
+
+/* Reads the rings written by the programs started with -T <prefix> (one file <prefix>.<pid> per process) and reports
+   where the time of the connections went. Each record marks the start of a phase of a connection, the phase lasts
+   until the next record of the same connection:
+
+       connected      accepted/connected --> first request wait (client: VERS negotiation, request sending)
+       wait_request   select() of service() waiting for a request
+       request        request received, approval (server) / request sent, waiting for the header (client)
+       wait_writable  select() of service() waiting for the socket to be writable
+       open           fileCacheOpen() (fopen()/getFileStats() on a miss) and range check
+       send_header    header written, socket corked
+       first_byte     content requested --> first send/sendfile() done (server) or first recv() (client)
+       body           rest of the content
+       drain          last modification and uncork (server) / last modification read (client)
+       idle           response done --> next request or close
+
+   For each program and phase one line in the key=value form of the benchmarks: count, total, mean, p50, p99, max.
+   With -c the phases are also written as Chrome trace JSON (chrome://tracing, Perfetto): one track per connection,
+   grouped by the process that accepted or opened it. Client and server rings can be given together, their clocks
+   are the same CLOCK_MONOTONIC.
+
+   Usage: ./trace_report [-c chrome.json] <ring file> ... */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "../errlib.h"
+#include "../trace.h"
+
+/* CONSTANTS */
+
+#define MAXFILES 4096                                                       /* Ring files read */
+
+/* DATA TYPES */
+
+struct event
+{
+    struct  traceRecord rec;
+    int     program;                                                        /* Index in programs[] */
+};
+
+struct sample
+{
+    int     program;
+    int     phase;
+    uint64_t ns;
+};
+
+/* GLOBAL VARIABLES */
+
+char    *prog_name;
+char    programs[MAXFILES][32];                                             /* Names found in the ring headers */
+int     programCount;
+
+struct  event *events;
+size_t  eventCount, eventSize;
+
+
+int programIndex(const char *name)
+{
+    for(int i = 0; i < programCount; i++)
+        if(strcmp(programs[i], name) == 0)
+            return i;
+
+    snprintf(programs[programCount], sizeof(programs[0]), "%s", name);
+    return programCount++;
+}
+
+/* Appends the valid records of one ring to events[], oldest first */
+void loadRing(const char *path)
+{
+    struct  traceHeader header;
+    struct  traceRecord *records;
+    uint64_t head, first;
+    FILE    *fp;
+    int     program;
+
+    if((fp = fopen(path, "rb")) == NULL)
+        err_sys("(%s) error - can not open %s", prog_name, path);
+
+    if(fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+       header.recordSize != sizeof(struct traceRecord) || header.records == 0)
+        err_quit("(%s) error - %s is not a trace ring", prog_name, path);
+
+    if((records = malloc((size_t)header.records * sizeof(struct traceRecord))) == NULL)
+        err_sys("(%s) error - malloc() failed", prog_name);
+    if(fread(records, sizeof(struct traceRecord), header.records, fp) != header.records)
+        err_quit("(%s) error - %s is truncated", prog_name, path);
+    fclose(fp);
+
+    header.name[sizeof(header.name) - 1] = '\0';
+    program = programIndex(header.name);
+
+    head  = header.head;
+    first = head > header.records ? head - header.records : 0;              /* Older records have been overwritten */
+
+    if(eventCount + (head - first) > eventSize)
+    {
+        eventSize = (eventCount + (head - first)) * 2;
+        if((events = realloc(events, eventSize * sizeof(struct event))) == NULL)
+            err_sys("(%s) error - realloc() failed", prog_name);
+    }
+
+    for(uint64_t i = first; i < head; i++)
+    {
+        struct traceRecord *r = &records[i % header.records];
+
+        if(r->phase == TRACE_NONE || r->phase >= TRACE_PHASES)             /* Being written when the process stopped */
+            continue;
+
+        events[eventCount].rec     = *r;
+        events[eventCount].program = program;
+        eventCount++;
+    }
+
+    free(records);
+}
+
+int compareEvents(const void *a, const void *b)
+{
+    const struct traceRecord *x = &((const struct event *)a)->rec, *y = &((const struct event *)b)->rec;
+
+    if(x->conn != y->conn)
+        return x->conn < y->conn ? -1 : 1;
+    if(x->ns != y->ns)
+        return x->ns < y->ns ? -1 : 1;
+    return 0;
+}
+
+int compareSamples(const void *a, const void *b)
+{
+    const struct sample *x = a, *y = b;
+
+    if(x->program != y->program)
+        return x->program - y->program;
+    if(x->phase != y->phase)
+        return x->phase - y->phase;
+    return x->ns < y->ns ? -1 : x->ns > y->ns;
+}
+
+/* True if the phase started by events[i] ends with events[i+1] */
+int phaseEnds(size_t i)
+{
+    return i + 1 < eventCount &&
+           events[i + 1].rec.conn == events[i].rec.conn &&
+           events[i + 1].rec.phase != TRACE_CONNECT &&                      /* Descriptor reused by a new connection */
+           events[i].rec.phase != TRACE_CLOSE;
+}
+
+void printBreakdown(void)
+{
+    struct  sample *samples;
+    size_t  n = 0, start, end;
+    uint64_t total;
+
+    if((samples = malloc((eventCount + 1) * sizeof(struct sample))) == NULL)
+        err_sys("(%s) error - malloc() failed", prog_name);
+
+    for(size_t i = 0; i < eventCount; i++)
+        if(phaseEnds(i))
+        {
+            samples[n].program = events[i].program;
+            samples[n].phase   = events[i].rec.phase;
+            samples[n].ns      = events[i + 1].rec.ns - events[i].rec.ns;
+            n++;
+        }
+
+    qsort(samples, n, sizeof(struct sample), compareSamples);
+
+    for(start = 0; start < n; start = end)
+    {
+        total = 0;
+        for(end = start; end < n && samples[end].program == samples[start].program && samples[end].phase == samples[start].phase; end++)
+            total += samples[end].ns;
+
+        printf("program=%s phase=%s count=%zu total_ms=%.3f mean_us=%.1f p50_us=%.1f p99_us=%.1f max_us=%.1f\n",
+               programs[samples[start].program], tracePhaseName(samples[start].phase), end - start,
+               total / 1e6, total / 1e3 / (end - start),
+               samples[start + (end - start) * 50 / 100].ns / 1e3,
+               samples[start + (end - start) * 99 / 100].ns / 1e3,
+               samples[end - 1].ns / 1e3);
+    }
+
+    free(samples);
+}
+
+/* Complete ("X") events, one track (tid) per connection in the process (pid) that accepted or opened it */
+void writeChromeTrace(const char *path)
+{
+    FILE    *fp;
+    uint64_t origin = UINT64_MAX;
+    int     track = 0, separator = 0;
+    uint32_t pid;
+
+    if((fp = fopen(path, "w")) == NULL)
+        err_sys("(%s) error - can not create %s", prog_name, path);
+
+    for(size_t i = 0; i < eventCount; i++)
+        if(events[i].rec.ns < origin)
+            origin = events[i].rec.ns;
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+    for(size_t i = 0; i < eventCount; i++)
+    {
+        struct traceRecord *r = &events[i].rec;
+
+        pid = r->conn >> 32;
+
+        if(i == 0 || r->conn != events[i - 1].rec.conn || r->phase == TRACE_CONNECT)
+        {
+            if(i == 0 || pid != events[i - 1].rec.conn >> 32)                  /* Events are sorted by connection, so by pid */
+                fprintf(fp, "%s\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"args\":{\"name\":\"%s %u\"}}",
+                        separator++ ? "," : "", pid, programs[events[i].program], pid);
+
+            track++;
+            fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%d,\"args\":{\"name\":\"connection %d (fd %u)\"}}",
+                    pid, track, track, (uint32_t)r->conn);
+        }
+
+        if(!phaseEnds(i))
+            continue;
+
+        fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%u,\"tid\":%d,\"args\":{\"bytes\":%llu}}",
+                tracePhaseName(r->phase), programs[events[i].program], (r->ns - origin) / 1e3,
+                (events[i + 1].rec.ns - r->ns) / 1e3, pid, track, (unsigned long long)r->bytes);
+    }
+
+    fprintf(fp, "\n]}\n");
+
+    if(fclose(fp) != 0)
+        err_sys("(%s) error - can not write %s", prog_name, path);
+}
+
+int main(int argc, char *argv[])
+{
+    char    *chromePath = NULL;
+    int     opt;
+
+    prog_name = argv[0];
+
+    while((opt = getopt(argc, argv, "c:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'c': chromePath = optarg; break;
+            default:
+                err_quit("Usage: %s [-c chrome.json] <ring file> ...", prog_name);
+        }
+    }
+
+    if(optind == argc || argc - optind > MAXFILES)
+        err_quit("Usage: %s [-c chrome.json] <ring file> ...", prog_name);
+
+    for(int i = optind; i < argc; i++)
+        loadRing(argv[i]);
+
+    qsort(events, eventCount, sizeof(struct event), compareEvents);
+
+    printBreakdown();
+
+    if(chromePath != NULL)
+        writeChromeTrace(chromePath);
+
+    free(events);
+    return 0;
+}
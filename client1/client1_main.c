@@ -1,3 +1,4 @@
+#define     _GNU_SOURCE                                 /* splice() */
 #include    <time.h>
 #include    <fcntl.h>
 #include    <errno.h>
@@ -5,12 +6,46 @@
 #include    <string.h>
 #include    <sys/time.h>
 #include    <inttypes.h>
+#include    <pthread.h>
+#include    <sys/stat.h>
+#include    <endian.h>
 #include    "../errlib.h"
 #include    "../sockwrap.h"
+#include    "../protocol.h"
+#include    "../socktune.h"
+#include    "../trace.h"
+#include    "../progress.h"
 
 #define BUFLEN	  128                                   /* Buffer Length */
-#define MAXBUFLEN 1000                                  /* Buffer Length for file content chunks */
+#define MAXBUFLEN 1000                                  /* Smaller files are read at once */
 #define TIMEOUT   15                                    /* timeout is 15 seconds */
+#define SPLICE_PIPE_SIZE (1024*1024)                    /* Capacity requested for the pipe used in splice mode */
+#define MAXJOBS   64                                    /* Maximum number of parallel connections */
+#define MAXWINDOW 256                                   /* Maximum number of pipelined requests per connection */
+#define MINSEGMENT (1024*1024)                          /* Minimum length of a segment */
+#define MAXRETRIES 3                                    /* Resume mode: reconnections after a lost connection */
+#define RETRYDELAY 1                                    /* Resume mode: seconds between reconnections */
+
+/* DATA TYPES */
+
+struct segment                                          /* One range of a file (segmented mode) */
+{
+    char    *fileName;
+    int     fileDesc;
+    off_t   offset;
+    off_t   length;
+    long long fileLastMod;
+    int     result;
+};
+
+struct job                                              /* One file of the shared work queue (parallel mode) */
+{
+    char    *fileName;
+    int     status;                                     /* 0: waiting, 1: transferred, 2: failed */
+    long    size;
+    double  seconds;                                    /* From the request to the end of the response */
+    int     connection;
+};
 
 /* GLOBAL VARIABLES */
 
@@ -18,6 +53,21 @@ char    *prog_name;
 char    ackMsg[5] = "+OK\r\n";
 struct  timeval tval;
 int     activeSocket;                                   /* In order to use in signal handler */
+int     spliceMode = 0;                                 /* 1: file content is moved socket --> pipe --> file with splice(), never copied to user space */
+int     window = 1;                                     /* Number of GET requests sent before waiting for the responses (pipelining) */
+int     jobs = 1;                                       /* Number of parallel connections */
+int     segments = 1;                                   /* Number of parallel ranges of one file */
+int     resumeMode = 0;                                 /* 1: interrupted transfers are continued instead of restarted */
+int     tuneProfile = TUNE_NONE;                         /* Socket options and buffer sizing (-t lan|wan|latency) */
+size_t  chunkOption = 0;                                 /* Bytes per recv() of file content, 0 to adapt them during each transfer */
+int     protoVersion = PROTO_MAXVERSION;                /* Highest protocol version asked to the server, lowered if the server does not know VERS */
+int     showProgress = 1;                               /* Progress is not shown when several connections are receiving */
+int     statsMode = 0;                                  /* 1: the metrics of the server are printed (STATS), no file is transferred */
+struct  job *jobList;                                   /* Shared work queue of the parallel mode */
+int     jobCount;
+int     nextJob;
+pthread_mutex_t jobLock = PTHREAD_MUTEX_INITIALIZER;
+struct  sockaddr_in serverAddr;
 
 
 void setPromptColor(char *colorName)
@@ -50,10 +100,10 @@ void sigIntHandler(int signal)
     }
 }
 
-void printTransferInfo(char *fileName, uint32_t fileSize, uint32_t fileLastMod)
+void printTransferInfo(char *fileName, off_t fileSize, long long fileLastMod)
 {
-    off_t tmp_size      = fileSize;
-    time_t tmp_lastMod  = fileLastMod;
+    long long tmp_size  = fileSize;
+    time_t tmp_lastMod  = fileLastMod / 1000000000;                              /* Nanoseconds */
 
     struct tm lt;
     char timbuf[80];
@@ -65,117 +115,862 @@ void printTransferInfo(char *fileName, uint32_t fileSize, uint32_t fileLastMod)
     printf("\n\n     ===========================================================\n");
     setPromptColor("default");
     printf("     NAME OF FILE:\t\t\t%s\n", fileName);
-    printf("     SIZE OF FILE:\t\t\t%lu bytes\n", tmp_size);
+    printf("     SIZE OF FILE:\t\t\t%lld bytes\n", tmp_size);
     printf("     LAST MODIFICATION OF FILE:\t\t%s", timbuf);
     setPromptColor("green");
     printf("\n     ===========================================================\n");
 }
 
-int fileTransmission(int socket, char *fileName)
+/* Moves exactly fileSize bytes from the socket into the file through a pipe, without copying them to user space.
+   Returns 0 on success, 1 on error and -1 if splice() is not supported for this socket/file pair (nothing has been consumed) */
+int spliceFileContent(int socket, int fileDesc, off_t fileSize)
 {
-    char *rbuf;
-    int fileDesc;
-    int n;
-    uint32_t fileSize;
-    long    tmpFileSize;
-    long    transmittedSize = 0;
-    uint32_t fileLastMod;
+    int     pfd[2];
+    off_t   tmpFileSize = fileSize;
+    off_t   transmittedSize = 0;
+    ssize_t n, m;
+    int     result = 0;
+    struct  socketTuner tuner;
+
+    tunerInit(&tuner, socket, tuneProfile, 0);
 
-    rbuf = malloc(MAXBUFLEN * (sizeof *rbuf));
+    if(pipe(pfd) == -1)
+        return -1;
 
-    if((readn(socket, rbuf, strlen(ackMsg)) == strlen(ackMsg)) && (strcmp(rbuf, ackMsg) == 0))  /* To verify that the first 5 bytes are equal to "+OK\r\n
+    fcntl(pfd[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);                                              /* Bigger pipe, less splice() calls. Failure is not important */
 
-                                                                                                   IN CASE OF RECEIVING "-ERR\r\n" MESSAGE (FILE NOT FOUND etc.), THIS BLOCK WILL BE DISCARDED AND FUNCTION WILL RETURN 1 */
+    if(showProgress == 1)
+        progressStart("RECEIVING", fileSize);
+
+    while(tmpFileSize > 0)
     {
-        strcpy(rbuf, "");                                                                       /* Just a precaution */
+        n = splice(socket, NULL, pfd[1], NULL, (size_t)tmpFileSize, SPLICE_F_MOVE | SPLICE_F_MORE);   /* Never more than tmpFileSize, last modification date follows the content */
+
+        if(n < 0 && INTERRUPTED_BY_SIGNAL)
+            continue;
 
-        if((fileDesc = open(fileName, O_WRONLY | O_CREAT, 0777)) == -1)                         /* To create the file */
+        if(n < 0 && transmittedSize == 0 && (errno == EINVAL || errno == ENOSYS))
+        {
+            result = -1;
+            break;
+        }
+
+        if(n <= 0)
         {
             setPromptColor("red");
-            printf("File has not been created! Error Number: % d\n", errno);
+            printf("\nTransfer Error! Connection has been either aborted or harmed\n");
             setPromptColor("default");
-            return 1;
+            result = 1;
+            break;
         }
 
-        if(readn(socket, &fileSize, sizeof (uint32_t)) == sizeof (uint32_t))                     /* To read fileSize  */
+        if(transmittedSize == 0)
+            traceEvent(traceConnection(socket), TRACE_FIRST_BYTE, n);
+
+        tunerUpdate(&tuner, socket, n);
+
+        while(n > 0)                                                                            /* Drain the pipe into the file */
         {
-            fileSize = ntohl(fileSize);
+            m = splice(pfd[0], NULL, fileDesc, NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
 
-            tmpFileSize = fileSize;
+            if(m < 0 && INTERRUPTED_BY_SIGNAL)
+                continue;
 
-            if(fileSize <= MAXBUFLEN)
+            if(m <= 0)
             {
-                if(recv(socket, rbuf, fileSize, 0) == fileSize)
-                {
-                    if(write(fileDesc, rbuf, fileSize) != fileSize)
-                    {
-                        setPromptColor("red");
-                        printf("File has not been created! Error Number: % d\n", errno);
-                        setPromptColor("default");
-                        return 1;
-                    }
-                }
-                else
-                    return 1;
+                setPromptColor("red");
+                printf("File has not been created! Error Number: % d\n", errno);
+                setPromptColor("default");
+                progressEnd();
+                close(pfd[0]);
+                close(pfd[1]);
+                return 1;
             }
-            else
+
+            n -= m;
+            transmittedSize += m;
+            tmpFileSize -= m;
+            progressAdd(m);                                                                     /* Drawn by the reporter thread, not here */
+        }
+    }
+
+    progressEnd();
+
+    close(pfd[0]);
+    close(pfd[1]);
+    return result;
+}
+
+/* Reads a size field of a response: 4 bytes in version 1, 8 bytes in version 2. Returns 0 on success */
+int readSize(int socket, int version, off_t *size)
+{
+    uint32_t size32;
+    uint64_t size64;
+
+    if(version == PROTO_V1)
+    {
+        if(readn(socket, &size32, sizeof(uint32_t)) != sizeof(uint32_t))
+            return 1;
+        *size = ntohl(size32);
+    }
+    else
+    {
+        if(readn(socket, &size64, sizeof(uint64_t)) != sizeof(uint64_t))
+            return 1;
+        *size = be64toh(size64);
+    }
+
+    return 0;
+}
+
+/* Reads the last modification date that ends every response and converts it to nanoseconds since the Epoch
+   (version 1 only carries seconds). Returns 0 on success */
+int readMtime(int socket, int version, long long *mtime)
+{
+    uint32_t mtime32;
+    uint64_t mtime64;
+
+    if(version == PROTO_V1)
+    {
+        if(readn(socket, &mtime32, sizeof(uint32_t)) != sizeof(uint32_t))
+            return 1;
+        *mtime = ntohl(mtime32) * 1000000000LL;
+    }
+    else
+    {
+        if(readn(socket, &mtime64, sizeof(uint64_t)) != sizeof(uint64_t))
+            return 1;
+        *mtime = be64toh(mtime64);
+    }
+
+    return 0;
+}
+
+/* Connects to the server and asks for protocol version protoVersion with "VERS <version>CRLF".
+   A server that does not know VERS answers "-ERR" and closes the connection, then it is connected again speaking version 1.
+   Returns the socket and the negotiated version, -1 if the connection fails */
+int openConnection(int *version)
+{
+    char    tbuf[BUFLEN];
+    char    ack[sizeof(ackMsg)];
+    uint32_t chosen;
+    int     s;
+
+    for (;;)
+    {
+        if((s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+            return -1;
+
+        tuneSocket(s, tuneProfile);                                             /* Before connect(): the receive buffer decides the window scale */
+
+        if(connect(s, (struct sockaddr *) &serverAddr, sizeof(serverAddr)) != 0)
+        {
+            close(s);
+            return -1;
+        }
+
+        traceEvent(traceConnection(s), TRACE_CONNECT, 0);
+
+        *version = PROTO_V1;
+
+        if(protoVersion == PROTO_V1)
+            return s;
+
+        snprintf(tbuf, BUFLEN, "VERS %d\r\n", protoVersion);
+
+        if(writen(s, tbuf, strlen(tbuf)) != strlen(tbuf) || readn(s, ack, sizeof(ack)) != sizeof(ack))
+        {
+            close(s);
+            return -1;
+        }
+
+        if(memcmp(ack, ackMsg, sizeof(ackMsg)) != 0)                            /* Older server */
+        {
+            close(s);
+            protoVersion = PROTO_V1;
+            continue;
+        }
+
+        if(readn(s, &chosen, sizeof(uint32_t)) != sizeof(uint32_t))
+        {
+            close(s);
+            return -1;
+        }
+
+        *version = ntohl(chosen);
+        return s;
+    }
+}
+
+int fileTransmission(int socket, char *fileName, int version)
+{
+    char ack[sizeof(ackMsg)];
+    char *rbuf = NULL;
+    int fileDesc = -1;
+    int n;
+    int result = 1;
+    off_t   fileSize;
+    off_t   tmpFileSize;
+    off_t   transmittedSize = 0;
+    long long fileLastMod;
+    struct  chunkSizer chunk;
+    struct  socketTuner tuner;
+    uint64_t conn = traceConnection(socket);
+
+    chunkInit(&chunk, chunkOption);
+    tunerInit(&tuner, socket, tuneProfile, 0);
+
+    if((readn(socket, ack, sizeof(ackMsg)) != sizeof(ackMsg)) || (memcmp(ack, ackMsg, sizeof(ackMsg)) != 0))  /* To verify that the first 5 bytes are equal to "+OK\r\n"
+                                                                                                   IN CASE OF RECEIVING "-ERR\r\n" MESSAGE (FILE NOT FOUND etc.), FUNCTION WILL RETURN 1 */
+        goto out;
+
+    if((fileDesc = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0777)) == -1)                   /* To create the file, an older and longer copy must not leave its tail behind */
+    {
+        setPromptColor("red");
+        printf("File has not been created! Error Number: % d\n", errno);
+        setPromptColor("default");
+        goto out;
+    }
+
+    if(readSize(socket, version, &fileSize) != 0)                                               /* To read fileSize, 32 or 64 bits according to the version */
+        goto out;
+
+    tmpFileSize = fileSize;
+
+    if((rbuf = chunkBuffer(&chunk, fileSize)) == NULL)                                          /* No bigger than the file */
+        goto out;
+
+    traceEvent(conn, TRACE_BODY, fileSize);
+
+    if(spliceMode == 1 && (n = spliceFileContent(socket, fileDesc, fileSize)) != -1)          /* Falls back to recv()/write() below if splice() is not supported */
+    {
+        if(n != 0)
+            goto out;
+    }
+    else if(fileSize <= MAXBUFLEN)
+    {
+        if(readn(socket, rbuf, fileSize) != fileSize)
+            goto out;
+
+        traceEvent(conn, TRACE_FIRST_BYTE, fileSize);
+
+        if(write(fileDesc, rbuf, fileSize) != fileSize)
+        {
+            setPromptColor("red");
+            printf("File has not been created! Error Number: % d\n", errno);
+            setPromptColor("default");
+            goto out;
+        }
+    }
+    else
+    {
+        if(showProgress == 1)
+            progressStart("RECEIVING", fileSize);
+
+        while(tmpFileSize > 0)
+        {
+            n = recv(socket, rbuf, (tmpFileSize < (off_t)chunk.size) ? tmpFileSize : chunk.size, 0);  /* Never read beyond the file content, last modification date follows it */
+
+            if(n <= 0)
             {
-                setPromptColor("cyan");
-
-                while(tmpFileSize > 0)
-                {
-                    n = recv(socket, rbuf, MAXBUFLEN, 0);
-
-                    if(n == 0)
-                    {
-                        setPromptColor("red");
-                        printf("\nTransfer Error! Connection has been either aborted or harmed\n");
-                        close(socket);
-                        exit(EXIT_FAILURE);
-                    }
-
-                    if(write(fileDesc, rbuf, n) != n)
-                    {
-                        setPromptColor("red");
-                        printf("File has not been created! Error Number: % d\n", errno);
-                        setPromptColor("default");
-                        return 1;
-                    }
-
-                    transmittedSize += n;
-                    tmpFileSize -= n;
-
-                    printf("\rRECEIVING: %c%ld", '%', (transmittedSize*100/(long)fileSize));
-                    fflush(stdout);
-                }
+                setPromptColor("red");
+                printf("\nTransfer Error! Connection has been either aborted or harmed\n");
+                setPromptColor("default");
+                progressEnd();
+                goto out;
+            }
 
+            if(write(fileDesc, rbuf, n) != n)
+            {
+                setPromptColor("red");
+                printf("File has not been created! Error Number: % d\n", errno);
                 setPromptColor("default");
+                progressEnd();
+                goto out;
             }
 
-            if(readn(socket, &fileLastMod, sizeof (uint32_t)) == sizeof (uint32_t))                             /* To read file last modification date */
-                fileLastMod = ntohl(fileLastMod);
-            else
-                return 1;
+            if(transmittedSize == 0)
+                traceEvent(conn, TRACE_FIRST_BYTE, n);
+
+            transmittedSize += n;
+            tmpFileSize -= n;
+
+            chunkUpdate(&chunk, socket, n, 0);                                                  /* Bigger chunks while more data is waiting in the socket */
+            tunerUpdate(&tuner, socket, n);                                                     /* Receive buffer sized to the measured bandwidth-delay product */
+            progressAdd(n);                                                                     /* Drawn by the reporter thread, not here */
         }
-        else
-            return 1;
+
+        progressEnd();
     }
-    else
-        return 1;
+
+    traceEvent(conn, TRACE_DRAIN, fileSize);
+
+    if(readMtime(socket, version, &fileLastMod) != 0)                                          /* To read file last modification date */
+        goto out;
+
+    traceEvent(conn, TRACE_DONE, fileSize);
+
+    close(fileDesc);
+    fileDesc = -1;
 
     printTransferInfo(fileName, fileSize, fileLastMod);
+    result = 0;
 
-    strcpy(rbuf, "");
+out:                                                                                            /* -j workers live on after a failed file: nothing may leak */
+    if(fileDesc != -1)
+        close(fileDesc);
     free(rbuf);
+    return result;
+}
+
+/* Sends one request line. Returns 1 in case of timeout or error */
+int sendMessage(int socket, char *tbuf)
+{
+    size_t  msgLength;
+    int     n;
+    struct  timeval tv = tval;                                                  /* select() modifies the timeout */
+    fd_set  cset;
+    FD_ZERO(&cset);
+    FD_SET(socket, &cset);
+
+    msgLength = strlen(tbuf);
+
+    n = select(FD_SETSIZE, NULL, &cset, NULL, &tv);                             /* We call "select" and select will block until s is ready to write or until timeout expires */
+
+    if(n <= 0)
+    {
+        setPromptColor("red");
+        printf("Timeout has expired!\n");
+        return 1;
+    }
+
+    if(writen(socket, tbuf, msgLength) != (msgLength))
+    {
+        setPromptColor("red");
+        printf("Error in sending the message!\n");
+        setPromptColor("default");
+        return 1;
+    }
+
+    setPromptColor("cyan");
+    printf("Waiting...\n\n");
+    setPromptColor("default");
+
     return 0;
 }
 
+/* Sends "GET <fileName>CRLF". Returns 1 in case of timeout or error */
+int sendRequest(int socket, char *fileName)
+{
+    char    tbuf[BUFLEN];		                                                /* transmission buffer */
+
+    snprintf(tbuf, BUFLEN, "GET %s\r\n", fileName);                              /* tbuf = "GET <fileName>CRLF" */
+
+    if(sendMessage(socket, tbuf) != 0)
+        return 1;
+
+    traceEvent(traceConnection(socket), TRACE_REQUEST, strlen(tbuf));
+    return 0;
+}
+
+/* Asks the server for its metrics with "STATSCRLF" and prints the "name value" lines of the answer. Returns 0 on success */
+int printServerStats(void)
+{
+    char    tbuf[BUFLEN];
+    char    *text;
+    uint32_t textLen;
+    int     s, version;
+
+    if((s = openConnection(&version)) < 0)
+        return 1;
+
+    snprintf(tbuf, BUFLEN, "STATS\r\n");
+
+    if(sendMessage(s, tbuf) != 0 ||
+       readn(s, tbuf, sizeof(ackMsg)) != sizeof(ackMsg) || memcmp(tbuf, ackMsg, sizeof(ackMsg)) != 0 ||   /* "-ERR" from servers without STATS */
+       readn(s, &textLen, sizeof(textLen)) != sizeof(textLen))
+    {
+        close(s);
+        return 1;
+    }
+
+    if((textLen = ntohl(textLen)) == 0)                                                                 /* Nothing to print */
+    {
+        close(s);
+        return 0;
+    }
+
+    if(textLen > MAXSTATSLEN - sizeof(ackMsg) - sizeof(textLen))                                        /* Not a STATS response, nothing that big is allocated */
+    {
+        setPromptColor("red");
+        printf("Invalid length of the server metrics: %" PRIu32 " bytes\n", textLen);
+        setPromptColor("default");
+        close(s);
+        return 1;
+    }
+
+    if((text = malloc(textLen)) == NULL)
+    {
+        close(s);
+        return 1;
+    }
+
+    if(readn(s, text, textLen) != textLen)
+    {
+        free(text);
+        close(s);
+        return 1;
+    }
+
+    fwrite(text, 1, textLen, stdout);
+
+    free(text);
+    close(s);
+    return 0;
+}
+
+double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int takeJob(void)
+{
+    int j = -1;
+
+    pthread_mutex_lock(&jobLock);
+    if(nextJob < jobCount)
+        j = nextJob++;
+    pthread_mutex_unlock(&jobLock);
+
+    return j;
+}
+
+/* Parallel mode: one connection takes files from the shared work queue until the queue is empty.
+   Pipelining (-w) is applied on each connection. If the connection fails, its in-flight files are marked as failed. */
+void *connectionWorker(void *arg)
+{
+    int     id = (int)(intptr_t)arg;
+    int     inFlight[MAXWINDOW];                        /* Jobs requested and not received yet, in request order */
+    double  requested[MAXWINDOW];
+    int     head = 0, count = 0;
+    int     j, n, s, version;
+    struct  stat st;
+    struct  timeval tv;
+    fd_set  cset;
+
+    if((s = openConnection(&version)) < 0)                                      /* Its files are left in the queue for the other connections */
+    {
+        setPromptColor("red");
+        printf("Connection %d could not be established: %s\n", id, strerror(errno));
+        setPromptColor("default");
+        return NULL;
+    }
+
+    for (;;)
+    {
+        while(count < window && (j = takeJob()) != -1)
+        {
+            jobList[j].connection = id;
+            inFlight[(head + count) % MAXWINDOW] = j;
+            requested[(head + count) % MAXWINDOW] = now();
+            count++;
+
+            if(sendRequest(s, jobList[j].fileName) != 0)
+                goto failure;
+        }
+
+        if(count == 0)                                                          /* Work queue is empty */
+            break;
+
+        j = inFlight[head];
+
+        FD_ZERO(&cset);
+        FD_SET(s, &cset);
+        tv = tval;
+        n = select(FD_SETSIZE, &cset, NULL, NULL, &tv);
+
+        if(n <= 0 || fileTransmission(s, jobList[j].fileName, version) != 0)
+            goto failure;
+
+        jobList[j].status  = 1;
+        jobList[j].seconds = now() - requested[head];
+        jobList[j].size    = (stat(jobList[j].fileName, &st) == 0) ? (long)st.st_size : 0;
+
+        head = (head + 1) % MAXWINDOW;
+        count--;
+    }
+
+    close(s);
+    return NULL;
+
+failure:
+    setPromptColor("red");
+    printf("Connection %d has failed, its files are not transferred!\n", id);
+    setPromptColor("default");
+
+    for(; count > 0; count--, head = (head + 1) % MAXWINDOW)
+        jobList[inFlight[head]].status = 2;
+
+    close(s);
+    return NULL;
+}
+
+/* Parallel mode: <jobs> connections share the list of files. Returns the number of files not transferred */
+int parallelTransfer(char **fileNames, int fileCount)
+{
+    pthread_t threads[MAXJOBS];
+    long    totalSize = 0;
+    int     failures = 0;
+    double  start, elapsed;
+
+    if((jobList = calloc(fileCount, sizeof(struct job))) == NULL)
+        err_sys("(%s) error - calloc() failed", prog_name);
+    jobCount = fileCount;
+    nextJob  = 0;
+
+    for(int i = 0; i < fileCount; i++)
+        jobList[i].fileName = fileNames[i];
+
+    showProgress = 0;
+    start = now();
+
+    for(int i = 0; i < jobs; i++)
+        if(pthread_create(&threads[i], NULL, connectionWorker, (void *)(intptr_t)i) != 0)
+            err_sys("(%s) error - pthread_create() failed", prog_name);
+
+    for(int i = 0; i < jobs; i++)
+        pthread_join(threads[i], NULL);
+
+    elapsed = now() - start;
+
+    setPromptColor("green");
+    printf("\n\n     ===========================================================\n");
+    setPromptColor("default");
+    printf("     %-30s %12s %10s %5s\n", "FILE", "BYTES", "SECONDS", "CONN");
+
+    for(int i = 0; i < fileCount; i++)
+    {
+        if(jobList[i].status == 1)
+        {
+            printf("     %-30s %12ld %10.3f %5d\n", jobList[i].fileName, jobList[i].size, jobList[i].seconds, jobList[i].connection);
+            totalSize += jobList[i].size;
+        }
+        else
+        {
+            setPromptColor("red");
+            printf("     %-30s %12s\n", jobList[i].fileName, "NOT TRANSFERRED");
+            setPromptColor("default");
+            failures++;
+        }
+    }
+
+    printf("\n     %d files, %ld bytes in %.3f seconds over %d connections: %.2f MB/s\n",
+           fileCount - failures, totalSize, elapsed, jobs, totalSize / elapsed / 1e6);
+    setPromptColor("green");
+    printf("     ===========================================================\n");
+    setPromptColor("default");
+
+    free(jobList);
+    return failures;
+}
+
+/* Reads the header of a GETR or RESUME response.
+   Returns the number of bytes of the range, -2 if the server has refused the request ("-ERR") and -1 on connection error */
+off_t readRangeHeader(int socket, int version, off_t *fileSize)
+{
+    char    ack[sizeof(ackMsg)];
+    off_t   rangeLength;
+
+    if(readn(socket, ack, sizeof(ack)) != sizeof(ack))
+        return -1;
+
+    if(memcmp(ack, ackMsg, sizeof(ackMsg)) != 0)
+        return -2;
+
+    if(readSize(socket, version, fileSize) != 0 || readSize(socket, version, &rangeLength) != 0)
+        return -1;
+
+    return rangeLength;
+}
+
+/* Sends "GETR <fileName> <offset> <length>CRLF" and reads the header of the response. Returns as readRangeHeader() */
+off_t requestRange(int socket, int version, char *fileName, off_t offset, off_t length, off_t *fileSize)
+{
+    char    tbuf[BUFLEN];
+
+    snprintf(tbuf, BUFLEN, "GETR %s %lld %lld\r\n", fileName, (long long)offset, (long long)length);
+
+    if(sendMessage(socket, tbuf) != 0)
+        return -1;
+
+    return readRangeHeader(socket, version, fileSize);
+}
+
+/* Receives length bytes of a range and writes them in place with pwrite(). Returns the number of bytes received */
+off_t receiveRange(int socket, int fileDesc, off_t offset, off_t length)
+{
+    struct  chunkSizer chunk;
+    struct  socketTuner tuner;
+    char    *rbuf;
+    off_t   received = 0;
+    ssize_t n;
+
+    chunkInit(&chunk, chunkOption);
+    tunerInit(&tuner, socket, tuneProfile, 0);
+
+    if((rbuf = chunkBuffer(&chunk, length)) == NULL)
+        return 0;
+
+    while(received < length)
+    {
+        n = recv(socket, rbuf, (length - received < (off_t)chunk.size) ? length - received : chunk.size, 0);
+
+        if(n <= 0 || pwrite(fileDesc, rbuf, n, offset + received) != n)
+            break;
+
+        received += n;
+
+        chunkUpdate(&chunk, socket, n, 0);
+        tunerUpdate(&tuner, socket, n);
+    }
+
+    free(rbuf);
+    return received;
+}
+
+/* Segmented mode: one connection fetches one range and writes it in place */
+void *segmentWorker(void *arg)
+{
+    struct  segment *seg = arg;
+    off_t   fileSize;
+    int     s, version;
+
+    seg->result = 1;
+
+    if((s = openConnection(&version)) < 0)
+    {
+        err_ret("(%s) error - connection of segment at %lld failed", prog_name, (long long)seg->offset);
+        return NULL;
+    }
+
+    if(requestRange(s, version, seg->fileName, seg->offset, seg->length, &fileSize) == seg->length &&
+       receiveRange(s, seg->fileDesc, seg->offset, seg->length) == seg->length &&
+       readMtime(s, version, &seg->fileLastMod) == 0)
+        seg->result = 0;
+
+    close(s);
+    return NULL;
+}
+
+/* Segmented mode: the file is split into <segments> ranges fetched on parallel connections.
+   The size is learnt with a GETR of length 0, the destination file is preallocated and each range is written in place */
+int segmentedTransfer(char *fileName)
+{
+    struct  segment segs[MAXJOBS];
+    pthread_t threads[MAXJOBS];
+    off_t   fileSize;
+    long long fileLastMod;
+    off_t   segLength;
+    int     fileDesc;
+    int     s, version, count = 0;
+    int     result = 0;
+
+    if((s = openConnection(&version)) < 0)
+        err_sys("(%s) error - connect() failed", prog_name);
+
+    if(requestRange(s, version, fileName, 0, 0, &fileSize) != 0 ||
+       readMtime(s, version, &fileLastMod) != 0)
+    {
+        close(s);
+        return 1;
+    }
+    close(s);
+
+    if((fileDesc = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0777)) == -1)
+    {
+        setPromptColor("red");
+        printf("File has not been created! Error Number: % d\n", errno);
+        setPromptColor("default");
+        return 1;
+    }
+
+    if(fileSize > 0 && posix_fallocate(fileDesc, 0, fileSize) != 0 && ftruncate(fileDesc, fileSize) != 0)
+    {
+        close(fileDesc);
+        return 1;
+    }
+
+    segLength = (fileSize + segments - 1) / segments;
+    if(segLength < MINSEGMENT)                                                  /* Small files are not worth many connections */
+        segLength = MINSEGMENT;
+
+    for(off_t offset = 0; offset < fileSize; offset += segLength, count++)
+    {
+        segs[count].fileName = fileName;
+        segs[count].fileDesc = fileDesc;
+        segs[count].offset   = offset;
+        segs[count].length   = (fileSize - offset < segLength) ? fileSize - offset : segLength;
+
+        if(pthread_create(&threads[count], NULL, segmentWorker, &segs[count]) != 0)
+            err_sys("(%s) error - pthread_create() failed", prog_name);
+    }
+
+    for(int i = 0; i < count; i++)
+    {
+        pthread_join(threads[i], NULL);
+
+        if(segs[i].result != 0 || segs[i].fileLastMod != fileLastMod)          /* A different date means the file has changed during the transfer */
+            result = 1;
+    }
+
+    close(fileDesc);
+
+    if(result == 0)
+    {
+        setPromptColor("green");
+        printf("\n%s has been received in %d segments", fileName, count);
+        printTransferInfo(fileName, fileSize, fileLastMod);
+        setPromptColor("default");
+    }
+
+    return result;
+}
+
+/* Resume mode: while a file is being received, its size and last modification date (learnt with a GETR of length 0)
+   are kept in "<fileName>.resume". If that file exists, the local file is a partial copy and the transfer continues
+   from its end with RESUME, which the server refuses if the file has changed meanwhile. A lost connection is retried. */
+int resumableTransfer(char *fileName)
+{
+    char    infoName[BUFLEN];
+    char    tbuf[BUFLEN];
+    FILE    *info;
+    struct  stat st;
+    long long expectedSize, expectedMtime;                                      /* Last modification in nanoseconds */
+    long long fileLastMod;
+    off_t   fileSize;
+    off_t   offset;
+    off_t   length;
+    int     s, fileDesc, partial, version;
+
+    snprintf(infoName, BUFLEN, "%s.resume", fileName);
+
+    for(int attempt = 0; attempt <= MAXRETRIES; attempt++)
+    {
+        if(attempt > 0)
+            sleep(RETRYDELAY);
+
+        if((s = openConnection(&version)) < 0)
+        {
+            err_ret("(%s) error - connection failed", prog_name);
+            continue;
+        }
+
+        partial = 0;
+        if((info = fopen(infoName, "r")) != NULL)
+        {
+            partial = fscanf(info, "%lld %lld", &expectedSize, &expectedMtime) == 2 &&
+                      stat(fileName, &st) == 0 && st.st_size <= expectedSize;
+            fclose(info);
+        }
+
+        if(partial)
+        {
+            offset = st.st_size;
+
+            setPromptColor("cyan");
+            printf("Resuming %s from byte %lld of %lld\n", fileName, (long long)offset, expectedSize);
+            setPromptColor("default");
+        }
+        else                                                                    /* New transfer: learn size and date first */
+        {
+            if((length = requestRange(s, version, fileName, 0, 0, &fileSize)) != 0 ||
+               readMtime(s, version, &fileLastMod) != 0)
+            {
+                close(s);
+                if(length == -2)                                                /* File does not exist on server */
+                    return 1;
+                continue;
+            }
+
+            offset        = 0;
+            expectedSize  = fileSize;
+            expectedMtime = fileLastMod;
+
+            if((info = fopen(infoName, "w")) == NULL ||
+               (fileDesc = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0777)) == -1)
+            {
+                setPromptColor("red");
+                printf("File has not been created! Error Number: % d\n", errno);
+                setPromptColor("default");
+                close(s);
+                return 1;
+            }
+            fprintf(info, "%lld %lld\n", expectedSize, expectedMtime);
+            fclose(info);
+            close(fileDesc);
+        }
+
+        snprintf(tbuf, BUFLEN, "RESUME %s %lld %lld %lld\r\n", fileName, (long long)offset, expectedSize,
+                 (version == PROTO_V1) ? expectedMtime / 1000000000 : expectedMtime);      /* Version 1 dates are in seconds */
+
+        if(sendMessage(s, tbuf) != 0 || (length = readRangeHeader(s, version, &fileSize)) == -1)
+        {
+            close(s);
+            continue;
+        }
+
+        if(length == -2)                                                        /* File has changed on server, partial copy is useless */
+        {
+            setPromptColor("red");
+            printf("%s has changed on server, transfer restarts from the beginning\n", fileName);
+            setPromptColor("default");
+            unlink(infoName);
+            close(s);
+            continue;
+        }
+
+        if((fileDesc = open(fileName, O_WRONLY | O_CREAT, 0777)) == -1)
+        {
+            close(s);
+            return 1;
+        }
+
+        if(receiveRange(s, fileDesc, offset, length) != length ||
+           readMtime(s, version, &fileLastMod) != 0)
+        {
+            setPromptColor("red");
+            printf("\nTransfer Error! Connection has been either aborted or harmed, %s will be resumed\n", fileName);
+            setPromptColor("default");
+            close(fileDesc);
+            close(s);
+            continue;
+        }
+
+        close(fileDesc);
+        close(s);
+        unlink(infoName);
+
+        printTransferInfo(fileName, fileSize, fileLastMod);
+        return 0;
+    }
+
+    setPromptColor("red");
+    printf("%s could not be received, run the client again with -c to resume it\n", fileName);
+    setPromptColor("default");
+    return 1;
+}
+
 int main(int argc, char *argv[])
 {
-    char        tbuf[BUFLEN];		                                            /* transmission buffer */
     uint16_t    tport_n, tport_h;	                                            /* server port number (network byte/host byte order) */
     int		    s;
     int		    res;
+    int         version;
+    int         opt;
     struct      sockaddr_in	saddr;		                                        /* server address structure */
     struct      in_addr	sIPaddr; 	                                            /* server IP addr. structure */
 
@@ -186,10 +981,68 @@ int main(int argc, char *argv[])
     tval.tv_sec = TIMEOUT;                                                      /* Timeout for any client connection after the server has been initiated */
     tval.tv_usec = 0;
 
-    if (argc < 4)                                                               /* To verify correctness of the arguments */
+    while ((opt = getopt(argc, argv, "sw:j:r:cv:b:t:mT:")) != -1)                                /* Options before the positional arguments */
+    {
+        switch (opt)
+        {
+            case 's':                                                           /* Zero-copy receive: socket --> pipe --> file with splice() */
+                spliceMode = 1;
+                break;
+            case 'w':                                                           /* Pipelining: up to N requests in flight on the connection */
+                if((window = atoi(optarg)) < 1)
+                    window = 1;
+                if(window > MAXWINDOW)
+                    window = MAXWINDOW;
+                break;
+            case 'j':                                                           /* N parallel connections sharing the list of files */
+                if((jobs = atoi(optarg)) < 1)
+                    jobs = 1;
+                if(jobs > MAXJOBS)
+                    jobs = MAXJOBS;
+                break;
+            case 'c':                                                           /* Continue partial files, retry lost connections */
+                resumeMode = 1;
+                break;
+            case 'm':                                                           /* Metrics of the server, no file needed */
+                statsMode = 1;
+                break;
+            case 'v':                                                           /* Highest protocol version to ask for, 1 for old servers */
+                if((protoVersion = atoi(optarg)) < PROTO_V1 || protoVersion > PROTO_MAXVERSION)
+                    protoVersion = PROTO_MAXVERSION;
+                break;
+            case 'r':                                                           /* Each file is split into N ranges fetched on parallel connections */
+                if((segments = atoi(optarg)) < 1)
+                    segments = 1;
+                if(segments > MAXJOBS)
+                    segments = MAXJOBS;
+                break;
+            case 'b':                                                           /* Bytes per recv(): "auto" (grows from 64 KB while it helps) or a size with k, m suffixes */
+                if((chunkOption = parseChunkSize(optarg)) == (size_t)-1)
+                    goto usage;
+                break;
+            case 't':                                                           /* Socket tuning profile, the chosen values are logged */
+                if((tuneProfile = tuneProfileByName(optarg)) == TUNE_NONE)
+                    goto usage;
+                break;
+            case 'T':                                                           /* Phases of each transfer are traced in the file <prefix>.<pid> */
+                if(traceInit(optarg, argv[0]) != 0)
+                    goto usage;
+                break;
+            default:
+            usage:                                                              /* Unknown option or invalid value */
+                setPromptColor("red");
+                printf("Usage: ./client1_main [-s] [-w <window>] [-j <connections>] [-r <segments>] [-c] [-v <version>] [-b auto|<chunk size>] [-t lan|wan|latency] [-m] [-T trace prefix] <IP Addr> <Port> <File1> <File2> ...\n");
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    argc -= optind - 1;                                                         /* From now on argv[1] is the IP address as before */
+    argv += optind - 1;
+
+    if (argc < (statsMode ? 3 : 4))                                             /* To verify correctness of the arguments */
     {
         setPromptColor("red");
-        printf("Invalid amount of arguments!\n Usage: ./client1_main <IP Addr> <Port> <File1> <File2> ...\n");
+        printf("Invalid amount of arguments!\n Usage: ./client1_main [-s] [-w <window>] [-j <connections>] [-r <segments>] [-c] [-v <version>] [-b auto|<chunk size>] [-t lan|wan|latency] [-m] [-T trace prefix] <IP Addr> <Port> <File1> <File2> ...\n");
         exit(EXIT_FAILURE);
     }
 
@@ -210,15 +1063,48 @@ int main(int argc, char *argv[])
 
     tport_n = htons(tport_h);                                                   /* To be sure in saving port number in network byte order. */
 
-    /* Socket Creation */
-    setPromptColor("cyan");
-    printf("Creating socket\n");
-    s = Socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    setPromptColor("green");
-    printf("Done, socket number %u\n", s);
-    setPromptColor("default");
+    bzero(&serverAddr, sizeof(serverAddr));
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_port   = tport_n;
+    serverAddr.sin_addr   = sIPaddr;
 
-    activeSocket = s;
+    progressInit();                                                             /* Reporter thread, only if stdout is a terminal */
+
+    if (statsMode == 1)
+        exit(printServerStats() == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+
+    if (resumeMode == 1)                                                        /* Resume mode, files one after another */
+    {
+        for(int i=3; i<argc; i++)
+        {
+            if(resumableTransfer(argv[i]) != 0)
+            {
+                setPromptColor("red");
+                printf("Transmission of %s has failed! Program is terminated! \n", argv[i]);
+                setPromptColor("default");
+                exit(EXIT_FAILURE);
+            }
+        }
+        exit(EXIT_SUCCESS);
+    }
+
+    if (segments > 1)                                                           /* Segmented mode, files one after another, ranges of each file in parallel */
+    {
+        for(int i=3; i<argc; i++)
+        {
+            if(segmentedTransfer(argv[i]) != 0)
+            {
+                setPromptColor("red");
+                printf("Transmission of %s has failed! Program is terminated! \n", argv[i]);
+                setPromptColor("default");
+                exit(EXIT_FAILURE);
+            }
+        }
+        exit(EXIT_SUCCESS);
+    }
+
+    if (jobs > 1)                                                               /* Parallel mode, every connection is created by its own thread */
+        exit(parallelTransfer(&argv[3], argc - 3) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
 
     /* prepare address structure */
     bzero(&saddr, sizeof(saddr));
@@ -231,65 +1117,44 @@ int main(int argc, char *argv[])
     showAddr("Connecting to target address", &saddr);
     setPromptColor("default");
 
-    Connect(s, (struct sockaddr *) &saddr, sizeof(saddr));
+    if((s = openConnection(&version)) < 0)                                      /* Socket creation, connection and protocol negotiation */
+        err_sys("(%s) error - connect() failed", prog_name);
+
+    activeSocket = s;
 
     setPromptColor("green");
-    printf("Done.\n");
+    printf("Done, socket number %u, protocol version %d.\n", s, version);
     setPromptColor("default");
 
     /* Client Main Loop */
-    for(int i=3; i<argc; i++)
+    for(int i=3, next=3; i<argc; i++)
     {
         fd_set cset;
         FD_ZERO(&cset);
         FD_SET(s, &cset);
 
         size_t n;
-        size_t msgLength;
-
-        strcpy(tbuf, "GET ");
-        strcat(tbuf, argv[i]);
-        strcat(tbuf, "\r\n");                                                   /* tbuf = "GET <fileName>CRLF" */
+        struct timeval tv;
 
-        msgLength = strlen(tbuf);
-
-        n = select(FD_SETSIZE, NULL, &cset, NULL, &tval);                       /* We call "select" and select will block until s is ready to read or until timeout expires */
-
-        if(n > 0)
+        while(next < argc && next - i < window)                                 /* Keep up to <window> requests in flight, responses come back in the same order */
         {
-            if(writen(s, tbuf, msgLength) != (msgLength))
+            if(sendRequest(s, argv[next]) != 0)
             {
-                setPromptColor("red");
-                printf("Error in sending the message!\n");
-                setPromptColor("default");
-
-                break;
-            }
-            else
-            {
-                setPromptColor("cyan");
-                printf("Waiting...\n\n");
-                setPromptColor("default");
-
-                strcpy(tbuf, "");
+                close(s);
+                exit(EXIT_FAILURE);
             }
+            next++;
+        }
 
-            n = select(FD_SETSIZE, &cset, NULL, NULL, &tval);
+        tv = tval;
+        n = select(FD_SETSIZE, &cset, NULL, NULL, &tv);
 
-            if(n > 0)                                                           /* If file transfer request is neither approved nor declined by server in 15 seconds, connection is closed by server side */
-            {
-                if(fileTransmission(s, argv[i]) != 0)                           /* In case of receiving "-ERR\r\n" message or etc. */
-                {
-                    setPromptColor("red");
-                    printf("Transmission has failed! Program is terminated! \n");
-                    close(s);
-                    exit(EXIT_FAILURE);
-                }
-            }
-            else
+        if(n > 0)                                                               /* If file transfer request is neither approved nor declined by server in 15 seconds, connection is closed by server side */
+        {
+            if(fileTransmission(s, argv[i], version) != 0)                               /* In case of receiving "-ERR\r\n" message or etc. */
             {
                 setPromptColor("red");
-                printf("Timeout has expired!\n");
+                printf("Transmission has failed! Program is terminated! \n");
                 close(s);
                 exit(EXIT_FAILURE);
             }
@@ -14,11 +14,273 @@ reference: Stevens, Unix network programming (3ed)
 #include <syslog.h>
 #include <string.h>
 #include <errno.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "errlib.h"
 
 #define MAXLINE 4095
 
+#define LOG_QUEUE	1024		/* Records waiting for the flusher, a power of two */
+#define LOG_RECORD	256		/* Bytes of text per record, longer messages are cut */
+#define LOG_FLUSH_MS	20		/* The flusher wakes up 50 times per second */
+#define LOG_BATCH	65536		/* Bytes written at a time */
+
 int daemon_proc = 0; /* set to 0 if stdout/stderr available, else set to 1 */
 
+struct logCell {
+	atomic_size_t seq;		/* Position it can be written at, that position + 1 once written */
+	int	level;
+	int	len;
+	char	text[LOG_RECORD];
+};
+
+static int logLevel = LOG_DEBUG;		/* Messages less important than this one are discarded */
+static int asyncMode;				/* err_async() has been called */
+static int colors;				/* stderr is a terminal */
+static struct logCell queue[LOG_QUEUE];
+static atomic_size_t tail;			/* Next position to write, taken by the producers */
+static size_t head;				/* Next position to read, by the consumer only */
+static atomic_ulong dropped;			/* Messages lost because the queue was full */
+static pthread_mutex_t consumer = PTHREAD_MUTEX_INITIALIZER;	/* Guards head and writing, never held during a write */
+static int writing;				/* A batch is being written by the flusher or err_flush() */
+
+static const char *levelNames[] = { "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug" };
+
+
+/* Formats the message in a free cell, never waits. Returns -1 (and counts the message) if the queue is full */
+
+static int enqueue (int errnoflag, int level, const char *fmt, va_list ap) {
+	int errno_save = errno;
+	struct logCell *cell;
+	size_t pos, seq;
+	int n;
+
+	pos = atomic_load_explicit(&tail, memory_order_relaxed);
+	for (;;) {
+		cell = &queue[pos % LOG_QUEUE];
+		seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+		if (seq == pos) {
+			if (atomic_compare_exchange_weak_explicit(&tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+				break;
+		}
+		else if ((long)(seq - pos) < 0) {		/* The flusher has not read this cell yet */
+			atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+			return -1;
+		}
+		else
+			pos = atomic_load_explicit(&tail, memory_order_relaxed);
+	}
+
+	n = vsnprintf(cell->text, LOG_RECORD - 1, fmt, ap);
+	if (n < 0)
+		n = 0;
+	if (n > LOG_RECORD - 2)
+		n = LOG_RECORD - 2;
+	if (errnoflag && n < LOG_RECORD - 2) {
+		n += snprintf(cell->text + n, LOG_RECORD - 1 - n, ": %s", strerror(errno_save));
+		if (n > LOG_RECORD - 2)
+			n = LOG_RECORD - 2;
+	}
+	cell->text[n++] = '\n';
+	cell->len = n;
+	cell->level = level;
+
+	atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+	return 0;
+}
+
+
+static void writeBatch (const char *batch, size_t len) {
+	ssize_t n = write(STDERR_FILENO, batch, len);
+
+	(void)n;			/* Nowhere to report a failure */
+}
+
+
+/* Appends n bytes of s to the batch as one record of the given level */
+
+static void batchAdd (char *batch, size_t *len, int *levels, int *lens, int *records, int level, const char *s, size_t n) {
+	memcpy(batch + *len, s, n);
+	*len += n;
+	levels[*records] = level;
+	lens[*records] = n;
+	(*records)++;
+}
+
+
+/* Moves the records queued so far into batch, as long as they fit in LOG_BATCH bytes, and frees their cells.
+ * Called with consumer held: nothing is written here. Returns the number of records taken, *more is set if some
+ * are left for the next batch */
+
+static int collect (char *batch, size_t *len, int *levels, int *lens, int *more) {
+	struct logCell *cell;
+	unsigned long lost;
+	const char *color;
+	char line[LOG_RECORD + 16];
+	int records = 0, n;
+
+	*len = 0;
+	*more = 0;
+
+	if ((lost = atomic_exchange_explicit(&dropped, 0, memory_order_relaxed)) != 0) {
+		n = snprintf(line, sizeof(line), "%lu log messages dropped\n", lost);
+		batchAdd(batch, len, levels, lens, &records, LOG_WARNING, line, n);
+	}
+
+	for (;;) {
+		cell = &queue[head % LOG_QUEUE];
+		if (atomic_load_explicit(&cell->seq, memory_order_acquire) != head + 1)
+			break;			/* Empty, or still being formatted */
+
+		color = !colors || daemon_proc ? NULL : cell->level <= LOG_WARNING ? "\033[1;31m" : cell->level == LOG_NOTICE ? "\033[1;32m" : NULL;
+		n = snprintf(line, sizeof(line), "%s%.*s%s", color ? color : "", cell->len, cell->text, color ? "\033[0m" : "");
+		if (*len + n > LOG_BATCH) {
+			*more = 1;
+			break;
+		}
+		batchAdd(batch, len, levels, lens, &records, cell->level, line, n);
+
+		atomic_store_explicit(&cell->seq, head + LOG_QUEUE, memory_order_release);	/* Free for the next round */
+		head++;
+	}
+
+	return records;
+}
+
+
+/* Writes the records queued so far. The batches are taken under consumer and written without it, one writer at a
+ * time: the lock is never held during a write(), so fork() (see forkPrepare()) never waits for a stalled terminal */
+
+static void drain (void) {
+	static char batch[LOG_BATCH];
+	static int levels[LOG_QUEUE + 1], lens[LOG_QUEUE + 1];	/* One more for the dropped messages line */
+	struct timespec pause = { 0, 1000000L };
+	size_t len;
+	int records, more;
+
+	do {
+		pthread_mutex_lock(&consumer);
+		if (writing) {			/* err_flush() and the flusher at the same time */
+			pthread_mutex_unlock(&consumer);
+			nanosleep(&pause, NULL);
+			more = 1;
+			continue;
+		}
+		records = collect(batch, &len, levels, lens, &more);
+		writing = records > 0;
+		pthread_mutex_unlock(&consumer);
+
+		if (records == 0)
+			return;
+
+		if (daemon_proc)
+			for (int i = 0, off = 0; i < records; off += lens[i++])
+				syslog(levels[i], "%.*s", lens[i], batch + off);
+		else
+			writeBatch(batch, len);
+
+		pthread_mutex_lock(&consumer);
+		writing = 0;
+		pthread_mutex_unlock(&consumer);
+	} while (more);
+}
+
+
+static void *flusher (void *arg) {
+	struct timespec interval = { 0, LOG_FLUSH_MS * 1000000L };
+
+	(void)arg;
+	for (;;) {
+		nanosleep(&interval, NULL);
+		drain();
+	}
+	return NULL;
+}
+
+
+static int startFlusher (void) {
+	pthread_t tid;
+
+	if (pthread_create(&tid, NULL, flusher, NULL) != 0)
+		return -1;
+	pthread_detach(tid);
+	return 0;
+}
+
+
+/* fork(): consumer is only held while records are moved, never while writing, so the prepare handler gets it at
+ * once and writes nothing. The records queued so far are written by the parent; the child drops its copies of
+ * them and starts its own flusher (threads are not inherited) */
+
+static void forkPrepare (void) {
+	pthread_mutex_lock(&consumer);
+}
+
+static void forkParent (void) {
+	pthread_mutex_unlock(&consumer);
+}
+
+static void forkChild (void) {
+	size_t t = atomic_load_explicit(&tail, memory_order_relaxed);
+
+	for (; head != t; head++)	/* Also the cells other threads of the parent were still formatting */
+		atomic_store_explicit(&queue[head % LOG_QUEUE].seq, head + LOG_QUEUE, memory_order_relaxed);
+	atomic_store_explicit(&dropped, 0, memory_order_relaxed);
+	writing = 0;			/* The parent's flusher may have been writing */
+
+	pthread_mutex_unlock(&consumer);
+	if (startFlusher() != 0)
+		asyncMode = 0;		/* Back to direct writes */
+}
+
+
+/* Writes what is still queued, in the calling thread. Called at exit */
+
+void err_flush (void) {
+	if (!asyncMode)
+		return;
+
+	fflush(stdout);
+	drain();
+}
+
+
+/* From now on messages are queued and written by a background thread, those less important than level are
+ * discarded. Returns 0, or -1 if the thread can not be created (messages are then written directly) */
+
+int err_async (int level) {
+	logLevel = level;
+
+	if (asyncMode)
+		return 0;
+
+	for (size_t i = 0; i < LOG_QUEUE; i++)
+		atomic_init(&queue[i].seq, i);
+
+	colors = isatty(STDERR_FILENO);
+
+	if (startFlusher() != 0)
+		return -1;
+
+	pthread_atfork(forkPrepare, forkParent, forkChild);
+	atexit(err_flush);		/* err_sys() and err_quit() messages are written before the process ends */
+	asyncMode = 1;
+	return 0;
+}
+
+
+/* "err", "warning", "notice", "info" or "debug", -1 if unknown */
+
+int err_level_by_name (const char *name) {
+	for (int i = LOG_ERR; i <= LOG_DEBUG; i++)
+		if (strcmp(name, levelNames[i]) == 0)
+			return i;
+	return -1;
+}
+
 
 /* Print message and return to caller
  * Caller specifies "errnoflag" and "level" */
@@ -28,6 +290,16 @@ static void err_doit (int errnoflag, int level, const char *fmt, va_list ap) {
 	size_t n;
 	char buf[MAXLINE+1];
 
+	if (level > logLevel)
+		return;
+
+	if (asyncMode) {
+		errno = errno_save;
+		if (enqueue(errnoflag, level, fmt, ap) == 0 || level > LOG_ERR)
+			return;
+		/* Queue full: a fatal message is written now, fmt has not been used yet */
+	}
+
 	vsnprintf (buf, MAXLINE, fmt, ap);
 	n = strlen(buf);
 	if (errnoflag)
@@ -83,6 +355,18 @@ void err_msg (const char *fmt, ...) {
 	return;
 }
 
+/* Diagnostic of the given syslog level, without errno
+ * Print message and return */
+
+void err_log (int level, const char *fmt, ...) {
+	va_list ap;
+
+	va_start (ap, fmt);
+	err_doit (0, level, fmt, ap);
+	va_end (ap);
+	return;
+}
+
 /* Fatal error unrelated to system call
  * Print message and terminate */
 
@@ -13,9 +13,23 @@ reference: Stevens, Unix network programming (3ed)
 #define _ERRLIB_H
 
 #include <stdarg.h>
+#include <syslog.h>
 
 extern int daemon_proc;
 
+/* By default every message is written before the function returns. After err_async() the messages are formatted
+ * into a bounded lock-free queue and written in batches by a background thread: a stalled terminal or syslog
+ * never blocks the caller, when the queue is full the message is dropped (and counted) instead.
+ * Messages less important than the chosen syslog level are discarded in both modes. */
+
+int err_async (int level);
+
+int err_level_by_name (const char *name);
+
+void err_flush (void);
+
+void err_log (int level, const char *fmt, ...);
+
 void err_msg (const char *fmt, ...);
 
 void err_quit (const char *fmt, ...);
@@ -0,0 +1,387 @@
+/*
+
+module: filecache.c
+
+purpose: bounded LRU cache of open files and of their size and last modification, keyed by path,
+	 and of the content of small files within a memory budget.
+	 A hit costs no system call; changed files are dropped when inotify reports them.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "filecache.h"
+
+#define SEG_PROBATION	1
+#define SEG_PROTECTED	2
+
+#define WATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF)	/* IN_ATTRIB also reports unlink() and rename() over the file */
+
+static struct cachedFile **table;
+static unsigned tableMask;
+static struct cachedFile *lruHead, *lruTail;
+static int count;
+static int capacity;
+static int inotifyFd = -1;
+
+static struct contentList {
+	struct cachedFile *head, *tail;
+	size_t bytes;
+} segs[3];		/* Indexed by segment, 0 is unused */
+static size_t budget;
+static struct cacheStats stats;
+
+
+static unsigned hash_path (const char *path) {
+	unsigned h = 2166136261u;	/* FNV-1a */
+
+	while (*path)
+		h = (h ^ (unsigned char)*path++) * 16777619u;
+	return h;
+}
+
+
+static struct cachedFile *find (const char *path, unsigned h) {
+	struct cachedFile *f;
+
+	for (f = table[h & tableMask]; f != NULL; f = f->hnext)
+		if (f->hash == h && strcmp(f->path, path) == 0)
+			break;
+	return f;
+}
+
+
+static void free_entry (struct cachedFile *f) {
+	close(f->fd);
+	free(f->content);
+	free(f->path);
+	free(f);
+}
+
+
+static void content_unlink (struct cachedFile *f) {
+	struct contentList *l = &segs[f->segment];
+
+	if (f->cprev != NULL)
+		f->cprev->cnext = f->cnext;
+	else
+		l->head = f->cnext;
+	if (f->cnext != NULL)
+		f->cnext->cprev = f->cprev;
+	else
+		l->tail = f->cprev;
+
+	l->bytes -= f->size;
+	f->segment = 0;
+	f->cprev = f->cnext = NULL;
+}
+
+
+static void content_push (struct cachedFile *f, int segment) {
+	struct contentList *l = &segs[segment];
+
+	f->segment = segment;
+	f->cprev = NULL;
+	f->cnext = l->head;
+	if (l->head != NULL)
+		l->head->cprev = f;
+	l->head = f;
+	if (l->tail == NULL)
+		l->tail = f;
+	l->bytes += f->size;
+}
+
+
+/* Frees the least recently used content that is not being sent, probation segment first.
+ * Returns 0 if nothing can be evicted */
+
+static int content_evict (void) {
+	struct cachedFile *f;
+
+	for (int seg = SEG_PROBATION; seg <= SEG_PROTECTED; seg++)
+		for (f = segs[seg].tail; f != NULL; f = f->cprev)
+			if (f->refs == 0) {
+				content_unlink(f);
+				free(f->content);
+				f->content = NULL;
+				stats.evictions++;
+				return 1;
+			}
+	return 0;
+}
+
+
+/* Removes the entry from the table and the LRU list. It is freed now or when its last reference is released */
+
+static void detach (struct cachedFile *f) {
+	struct cachedFile **p;
+
+	for (p = &table[f->hash & tableMask]; *p != f; p = &(*p)->hnext)
+		;
+	*p = f->hnext;
+
+	if (f->prev != NULL)
+		f->prev->next = f->next;
+	else
+		lruHead = f->next;
+	if (f->next != NULL)
+		f->next->prev = f->prev;
+	else
+		lruTail = f->prev;
+
+	if (f->wd != -1) {
+		for (struct cachedFile *g = lruHead; g != NULL; g = g->next)
+			if (g->wd == f->wd)	/* Another path of the same file, the watch is still needed */
+				goto shared;
+		inotify_rm_watch(inotifyFd, f->wd);
+	}
+shared:
+	if (f->segment != 0)
+		content_unlink(f);	/* Memory is freed with the entry, it may still be sent */
+	f->cached = 0;
+	count--;
+
+	if (f->refs == 0)
+		free_entry(f);
+}
+
+
+static void move_to_front (struct cachedFile *f) {
+	if (f == lruHead)
+		return;
+
+	f->prev->next = f->next;
+	if (f->next != NULL)
+		f->next->prev = f->prev;
+	else
+		lruTail = f->prev;
+
+	f->prev = NULL;
+	f->next = lruHead;
+	lruHead->prev = f;
+	lruHead = f;
+}
+
+
+/* Creates the table for up to size entries.
+ * Returns the inotify descriptor to be watched by the caller, -1 if changes can not be notified */
+
+int fileCacheInit (int size, size_t contentBudget) {
+	unsigned n = 1;
+
+	while (n < 2 * (unsigned)size)
+		n <<= 1;
+
+	if ((table = calloc(n, sizeof(*table))) == NULL)
+		return -1;
+
+	tableMask = n - 1;
+	capacity = size;
+	budget = contentBudget;
+	inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+	return inotifyFd;
+}
+
+
+/* Returns a new reference to the cached file, NULL if path is not cached */
+
+struct cachedFile *fileCacheLookup (const char *path) {
+	struct cachedFile *f;
+	struct stat st;
+
+	if (table == NULL || (f = find(path, hash_path(path))) == NULL)
+		return NULL;
+
+	if (f->wd == -1 && (stat(path, &st) != 0 || st.st_size != f->size ||
+	    st.st_mtim.tv_sec != f->mtime.tv_sec || st.st_mtim.tv_nsec != f->mtime.tv_nsec)) {
+		detach(f);	/* Not watched, checked at every lookup */
+		stats.invalidations++;
+		return NULL;
+	}
+
+	move_to_front(f);
+	f->refs++;
+	return f;
+}
+
+
+/* Adds an already opened file, the cache takes ownership of fd. The least recently used entry is evicted
+ * if the cache is full. Returns a new reference, NULL on error (fd is still owned by the caller) */
+
+struct cachedFile *fileCacheInsert (const char *path, int fd) {
+	struct cachedFile *f;
+	struct stat st;
+	unsigned h = hash_path(path);
+
+	if (table == NULL || capacity == 0 || (f = calloc(1, sizeof(*f))) == NULL)
+		return NULL;
+
+	if ((f->path = strdup(path)) == NULL) {
+		free(f);
+		return NULL;
+	}
+
+	if (find(path, h) != NULL)	/* Opened twice by concurrent misses, keep the newest */
+		detach(find(path, h));
+
+	while (count >= capacity)	/* Before the new watch: detach() may remove a watch shared with it */
+		detach(lruTail);
+
+	f->wd = -1;
+	if (inotifyFd != -1)	/* Watch first, so a change after fstat() is always reported */
+		f->wd = inotify_add_watch(inotifyFd, path, WATCH_MASK);
+
+	if (fstat(fd, &st) < 0) {
+		if (f->wd != -1)
+			inotify_rm_watch(inotifyFd, f->wd);
+		free(f->path);
+		free(f);
+		return NULL;
+	}
+
+	f->fd = fd;
+	f->size = st.st_size;
+	f->mtime = st.st_mtim;
+	f->dev = st.st_dev;
+	f->ino = st.st_ino;
+	f->refs = 1;
+	f->cached = 1;
+	f->hash = h;
+
+	f->hnext = table[h & tableMask];
+	table[h & tableMask] = f;
+	f->next = lruHead;
+	if (lruHead != NULL)
+		lruHead->prev = f;
+	lruHead = f;
+	if (lruTail == NULL)
+		lruTail = f;
+	count++;
+
+	return f;
+}
+
+
+/* Returns a reference to the cached file, opening it on a miss. NULL if the file can not be opened */
+
+struct cachedFile *fileCacheOpen (const char *path) {
+	struct cachedFile *f;
+	int fd;
+
+	if ((f = fileCacheLookup(path)) != NULL)
+		return f;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return NULL;
+
+	if ((f = fileCacheInsert(path, fd)) == NULL)
+		close(fd);
+
+	return f;
+}
+
+
+void fileCacheRelease (struct cachedFile *f) {
+	if (--f->refs == 0 && f->cached == 0)
+		free_entry(f);
+}
+
+
+/* Reads the pending inotify events and drops the files that have changed */
+
+void fileCacheInvalidate (void) {
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	struct cachedFile *f, *next;
+	ssize_t n;
+
+	if (inotifyFd == -1)
+		return;
+
+	while ((n = read(inotifyFd, buf, sizeof(buf))) > 0) {
+		for (char *p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len) {
+			ev = (struct inotify_event *)p;
+
+			if (ev->mask & IN_IGNORED)	/* Watch removed by detach() or file deleted, already reported */
+				continue;
+
+			for (f = lruHead; f != NULL; f = next) {
+				next = f->next;
+				if (f->wd == ev->wd) {
+					f->wd = -1;	/* The watch is removed below, once */
+					detach(f);
+					stats.invalidations++;
+				}
+			}
+			inotify_rm_watch(inotifyFd, ev->wd);
+		}
+	}
+}
+
+
+/* Returns the content of a small file (at most MAXCONTENTSIZE bytes), reading it on the first request if it fits
+ * in the budget, with the GET header and last modification of every version. NULL if the file is not kept in memory.
+ * The content stays valid as long as the reference to f */
+
+char *fileCacheContent (struct cachedFile *f) {
+	struct request get = { .command = CMD_GET };
+	char *content;
+
+	if (f->size > MAXCONTENTSIZE || (size_t)f->size > budget)
+		return NULL;
+
+	if (f->content != NULL) {
+		stats.hits++;
+		if (f->segment != 0) {	/* Requested again: protected */
+			content_unlink(f);
+			content_push(f, SEG_PROTECTED);
+			while (segs[SEG_PROTECTED].bytes > budget / 5 * 4 && segs[SEG_PROTECTED].tail != f) {
+				struct cachedFile *g = segs[SEG_PROTECTED].tail;	/* Back to probation, not evicted yet */
+
+				content_unlink(g);
+				content_push(g, SEG_PROBATION);
+			}
+		}
+		return f->content;
+	}
+
+	stats.misses++;
+
+	if (f->cached == 0)
+		return NULL;
+
+	while (segs[SEG_PROBATION].bytes + segs[SEG_PROTECTED].bytes + f->size > budget)
+		if (content_evict() == 0)
+			return NULL;	/* Everything is being sent */
+
+	if ((content = malloc(f->size > 0 ? f->size : 1)) == NULL)
+		return NULL;
+
+	if (pread(f->fd, content, f->size, 0) != f->size) {
+		free(content);
+		return NULL;
+	}
+
+	for (int v = PROTO_V1; v <= PROTO_MAXVERSION; v++) {
+		f->headerLen[v - 1] = buildHeader(f->header[v - 1], v, &get, f->size);
+		f->trailerLen[v - 1] = buildTrailer(f->trailer[v - 1], v, &f->mtime);
+	}
+
+	f->content = content;
+	content_push(f, SEG_PROBATION);
+	return content;
+}
+
+
+void fileCacheStats (struct cacheStats *st) {
+	*st = stats;
+	st->bytes = segs[SEG_PROBATION].bytes + segs[SEG_PROTECTED].bytes;
+	st->files = count;
+}
@@ -0,0 +1,78 @@
+/*
+
+module: filecache.h
+
+purpose: definitions of functions in filecache.c
+
+*/
+
+#ifndef _FILECACHE_H
+
+#define _FILECACHE_H
+
+#include <sys/types.h>
+#include <time.h>
+
+#include "protocol.h"
+
+#define MAXCONTENTSIZE	(64*1024)	/* Bigger files are never kept in memory */
+
+/* One open file. Entries are owned by the cache, callers only hold references.
+ * fd must not be closed nor its file position relied upon (use offsets: sendfile, pread, splice). */
+
+struct cachedFile {
+	char	*path;
+	int	fd;
+	off_t	size;
+	struct timespec mtime;
+	dev_t	dev;		/* Identify the file together with size and mtime (shared cache key) */
+	ino_t	ino;
+	int	refs;		/* References held by transfers in progress */
+	int	cached;		/* 0: evicted or invalidated, closed when the last reference is released */
+	int	wd;		/* inotify watch of the file, -1 if none */
+	char	*content;	/* Whole file in memory (small files only), NULL if not loaded */
+	char	header[PROTO_MAXVERSION][MAXHEADERLEN];	/* Response to GET without the content, for each version */
+	int	headerLen[PROTO_MAXVERSION];
+	char	trailer[PROTO_MAXVERSION][MAXTRAILERLEN];
+	int	trailerLen[PROTO_MAXVERSION];
+	unsigned hash;
+	struct cachedFile *hnext;		/* Hash chain */
+	struct cachedFile *prev, *next;		/* LRU list, most recently used first */
+	int	segment;	/* Content list holding the entry: 0 none, 1 probation, 2 protected */
+	struct cachedFile *cprev, *cnext;	/* Content list, most recently used first */
+};
+
+struct cacheStats {
+	unsigned long hits;		/* Content served from memory */
+	unsigned long misses;		/* Small file not in memory */
+	unsigned long evictions;	/* Content dropped to stay within the budget */
+	unsigned long invalidations;	/* Files dropped because they have changed */
+	size_t	bytes;			/* Content in memory */
+	int	files;			/* Open files */
+};
+
+/* The cache belongs to one process and is not thread safe.
+ * fileCacheInit() returns the inotify descriptor, to be watched by the event loop of the server:
+ * fileCacheInvalidate() has to be called when it becomes readable. -1 if files are not watched,
+ * then every lookup checks the file with stat().
+ * Small files are also kept in memory within contentBudget bytes, with a segmented LRU: content enters
+ * the probation segment and moves to the protected one (at most 4/5 of the budget) when requested again,
+ * so one scan of many files can only evict content requested once. */
+
+int fileCacheInit (int capacity, size_t contentBudget);
+
+struct cachedFile *fileCacheLookup (const char *path);
+
+struct cachedFile *fileCacheInsert (const char *path, int fd);
+
+struct cachedFile *fileCacheOpen (const char *path);
+
+void fileCacheRelease (struct cachedFile *f);
+
+void fileCacheInvalidate (void);
+
+char *fileCacheContent (struct cachedFile *f);
+
+void fileCacheStats (struct cacheStats *st);
+
+#endif
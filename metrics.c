@@ -0,0 +1,167 @@
+/*
+
+module: metrics.c
+
+purpose: counters, gauges and latency histograms of a server, shared by the processes it forks,
+	 and the text reported by the STATS request.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+
+#include "metrics.h"
+#include "protocol.h"
+
+struct registry {
+	double	start;				/* metricsClock() at metricsInit() */
+	atomic_long counter[METRICS];
+	atomic_long latency[SIZE_BUCKETS][LATENCY_SLOTS];
+};
+
+static const char *names[METRICS] = {
+	"connections_total", "connections_active", "requests_total", "bytes_sent_total",
+	"err_responses_total", "timeouts_total", "sigpipe_aborts_total"
+};
+
+static const char *sizeNames[SIZE_BUCKETS] = { "4K", "64K", "1M", "16M", "256M", "inf" };
+
+static struct registry local;			/* Until metricsInit() */
+static struct registry *reg = &local;
+
+
+double metricsClock (void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* Maps the registry. Must be called before forking. Returns 0 on success, -1 if the counters stay private */
+
+int metricsInit (void) {
+	void *p;
+
+	local.start = metricsClock();
+
+	p = mmap(NULL, sizeof(struct registry), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);	/* Zero filled */
+	if (p == MAP_FAILED)
+		return -1;
+
+	reg = p;
+	reg->start = local.start;
+	return 0;
+}
+
+
+void metricsAdd (int metric, long n) {
+	atomic_fetch_add_explicit(&reg->counter[metric], n, memory_order_relaxed);
+}
+
+
+/* Records the time taken by a response of size content bytes, from the request to the last byte sent */
+
+void metricsLatency (off_t size, double seconds) {
+	unsigned long us = seconds > 0 ? seconds * 1e6 : 0;
+	off_t limit = 4096;
+	int bucket = 0, slot;
+
+	while (bucket < SIZE_BUCKETS - 1 && size > limit) {
+		limit *= 16;
+		bucket++;
+	}
+
+	slot = us == 0 ? 0 : 64 - __builtin_clzl(us);	/* 2^(slot-1) <= us < 2^slot */
+	if (slot >= LATENCY_SLOTS)
+		slot = LATENCY_SLOTS - 1;
+
+	atomic_fetch_add_explicit(&reg->latency[bucket][slot], 1, memory_order_relaxed);
+}
+
+
+/* Upper bound (us) of the slot reached by the fraction p of the count responses of the histogram */
+
+static unsigned long percentile (const long *histogram, long count, double p) {
+	long seen = 0;
+
+	for (int slot = 0; slot < LATENCY_SLOTS; slot++)
+		if ((seen += histogram[slot]) >= p * count)
+			return 1UL << slot;
+	return 1UL << (LATENCY_SLOTS - 1);
+}
+
+
+/* Appends to the size bytes of text. A line that does not fit is cut, textLen never goes past the buffer */
+
+static void appendText (char *text, size_t size, size_t *textLen, const char *fmt, ...) {
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(text + *textLen, size - *textLen, fmt, ap);
+	va_end(ap);
+
+	if (n > 0)
+		*textLen = *textLen + n < size ? *textLen + n : size - 1;
+}
+
+
+/* Returns the response to STATS in a buffer to be freed by the caller, NULL if it can not be allocated.
+ * Counters are read one at a time while the other processes keep updating them */
+
+char *buildStatsReply (size_t *len) {
+	size_t size = MAXSTATSLEN, textLen = 0;
+	long histogram[LATENCY_SLOTS], count;
+	char *buf, *text;
+	uint32_t n;
+	int slot;
+
+	if ((buf = malloc(size)) == NULL)
+		return NULL;
+	text = buf + 9;		/* After "+OK\r\n" and the length */
+	size -= 9;
+
+	appendText(text, size, &textLen, "uptime_seconds %.0f\n", metricsClock() - reg->start);
+
+	for (int i = 0; i < METRICS; i++)
+		appendText(text, size, &textLen, "%s %ld\n", names[i],
+			   atomic_load_explicit(&reg->counter[i], memory_order_relaxed));
+
+	for (int b = 0; b < SIZE_BUCKETS; b++) {
+		count = 0;
+		for (slot = 0; slot < LATENCY_SLOTS; slot++)
+			count += histogram[slot] = atomic_load_explicit(&reg->latency[b][slot], memory_order_relaxed);
+		if (count == 0)
+			continue;
+
+		for (slot = LATENCY_SLOTS - 1; histogram[slot] == 0; slot--)
+			;
+
+		appendText(text, size, &textLen,
+			   "latency_count{size=\"%s\"} %ld\n"
+			   "latency_p50_us{size=\"%s\"} %lu\n"
+			   "latency_p99_us{size=\"%s\"} %lu\n"
+			   "latency_p999_us{size=\"%s\"} %lu\n"
+			   "latency_max_us{size=\"%s\"} %lu\n",
+			   sizeNames[b], count,
+			   sizeNames[b], percentile(histogram, count, 0.50),
+			   sizeNames[b], percentile(histogram, count, 0.99),
+			   sizeNames[b], percentile(histogram, count, 0.999),
+			   sizeNames[b], 1UL << slot);
+	}
+
+	memcpy(buf, "+OK\r\n", 5);
+	n = htonl(textLen);
+	memcpy(buf + 5, &n, 4);
+
+	*len = 9 + textLen;
+	return buf;
+}
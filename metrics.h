@@ -0,0 +1,43 @@
+/*
+
+module: metrics.h
+
+purpose: definitions of functions in metrics.c
+
+*/
+
+#ifndef _METRICS_H
+
+#define _METRICS_H
+
+#include <sys/types.h>
+
+#define METRIC_CONNECTIONS	0	/* Accepted connections */
+#define METRIC_ACTIVE		1	/* Gauge: connections open now */
+#define METRIC_REQUESTS		2	/* Request lines received, valid or not */
+#define METRIC_BYTES		3	/* Content bytes of the responses sent */
+#define METRIC_ERRORS		4	/* "-ERR" responses */
+#define METRIC_TIMEOUTS		5	/* Connections closed because no request arrived in time */
+#define METRIC_ABORTS		6	/* Responses cut by the client closing the connection (SIGPIPE, EPIPE) */
+#define METRICS			7
+
+#define SIZE_BUCKETS		6	/* Responses of up to 4 KB, 64 KB, 1 MB, 16 MB, 256 MB and bigger */
+#define LATENCY_SLOTS		32	/* Powers of two of microseconds, up to 35 minutes */
+
+/* The registry lives in a shared anonymous mapping created by metricsInit(), so the processes forked afterwards
+ * (server2) update and report the same counters. Updates are relaxed atomic additions, no lock and no system call:
+ * they can be made for every request, and from a signal handler. Without metricsInit(), or if the mapping can not
+ * be created, the counters belong to the calling process.
+ * The STATS request is answered with buildStatsReply(): "+OK\r\n" | text length (4) | "name value\n" lines. */
+
+int metricsInit (void);
+
+void metricsAdd (int metric, long n);
+
+double metricsClock (void);
+
+void metricsLatency (off_t size, double seconds);
+
+char *buildStatsReply (size_t *len);
+
+#endif
@@ -0,0 +1,138 @@
+/*
+
+module: progress.c
+
+purpose: progress line of the transfer in course, drawn by a reporter thread off the transfer loop.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "progress.h"
+
+#define COLOR	"\033[1;36m"		/* Cyan, as the progress lines have always been */
+#define NOCOLOR	"\033[0m"
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;	/* Taken by the reporter and at start and end of a transfer */
+static int	enabled;			/* Reporter running */
+static int	active;				/* A transfer is shown */
+static int	drawn;				/* Its line has been drawn at least once */
+static char	label[32];
+static off_t	total;
+static double	start, lastTime, rate;		/* Rate: bytes per second, smoothed */
+static long long lastBytes;
+static atomic_llong bytes;			/* Of the transfer in course, the only state touched by progressAdd() */
+
+
+static double clockNow (void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* Called with lock held */
+
+static void draw (int final) {
+	long long done = atomic_load_explicit(&bytes, memory_order_relaxed);
+	double t = clockNow(), instant;
+	long eta;
+
+	if (done > total)
+		done = total;
+
+	if (final)
+		rate = t > start ? done / (t - start) : 0;	/* Average of the whole transfer */
+	else if (t > lastTime) {
+		instant = (done - lastBytes) / (t - lastTime);
+		rate = drawn ? 0.7 * rate + 0.3 * instant : instant;
+	}
+	lastTime = t;
+	lastBytes = done;
+
+	printf(COLOR "\r%s: %3ld%% %9.1f MB/s", label, total > 0 ? (long)(done * 100 / total) : 100L, rate / 1e6);
+	if (!final && rate > 0) {
+		eta = (total - done) / rate;
+		printf("  ETA %ld:%02ld   ", eta / 60, eta % 60);
+	}
+	else
+		printf("            ");		/* Clear the ETA of the previous line */
+	fputs(final ? NOCOLOR "\n" : NOCOLOR, stdout);
+	fflush(stdout);
+
+	drawn = 1;
+}
+
+
+static void *reporter (void *arg) {
+	struct timespec interval = { 0, PROGRESS_INTERVAL_MS * 1000000L };
+
+	(void)arg;
+	for (;;) {
+		nanosleep(&interval, NULL);
+
+		pthread_mutex_lock(&lock);
+		if (active && clockNow() - start >= PROGRESS_INTERVAL_MS / 1000.0)
+			draw(0);
+		pthread_mutex_unlock(&lock);
+	}
+	return NULL;
+}
+
+
+/* Returns 0 if progress is shown, -1 if stdout is not a terminal or the reporter can not be started */
+
+int progressInit (void) {
+	pthread_t tid;
+
+	if (enabled)
+		return 0;
+	if (!isatty(STDOUT_FILENO) || pthread_create(&tid, NULL, reporter, NULL) != 0)
+		return -1;
+
+	pthread_detach(tid);
+	enabled = 1;
+	return 0;
+}
+
+
+void progressStart (const char *name, off_t size) {
+	if (!enabled)
+		return;
+
+	pthread_mutex_lock(&lock);
+	snprintf(label, sizeof(label), "%s", name);
+	total = size;
+	atomic_store_explicit(&bytes, 0, memory_order_relaxed);
+	start = lastTime = clockNow();
+	lastBytes = 0;
+	rate = 0;
+	drawn = 0;
+	active = 1;
+	pthread_mutex_unlock(&lock);
+}
+
+
+void progressAdd (size_t n) {
+	atomic_fetch_add_explicit(&bytes, n, memory_order_relaxed);
+}
+
+
+/* Draws the last line, with the average throughput, if the transfer has been shown */
+
+void progressEnd (void) {
+	if (!enabled)
+		return;
+
+	pthread_mutex_lock(&lock);
+	if (active && drawn)
+		draw(1);
+	active = 0;
+	pthread_mutex_unlock(&lock);
+}
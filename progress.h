@@ -0,0 +1,30 @@
+/*
+
+module: progress.h
+
+purpose: definitions of functions in progress.c
+
+*/
+
+#ifndef _PROGRESS_H
+
+#define _PROGRESS_H
+
+#include <sys/types.h>
+
+#define PROGRESS_INTERVAL_MS	200	/* The progress line is redrawn 5 times per second */
+
+/* One transfer at a time is shown, between progressStart() and progressEnd(). The transfer loop only calls
+ * progressAdd(), a relaxed atomic addition: no formatting, no lock, no system call. A reporter thread, started by
+ * progressInit() only if stdout is a terminal, redraws "label: percentage, throughput, ETA" at a fixed rate.
+ * A transfer ending before the first redraw prints nothing. */
+
+int progressInit (void);
+
+void progressStart (const char *label, off_t total);
+
+void progressAdd (size_t n);
+
+void progressEnd (void);
+
+#endif
@@ -0,0 +1,193 @@
+/*
+
+module: protocol.c
+
+purpose: parsing of the requests of the file transfer protocol
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <endian.h>
+#include <arpa/inet.h>
+
+#include "protocol.h"
+
+/* Parses the last space separated number of line and cuts it off.
+ * Returns -1 if there is no valid number */
+
+static off_t cut_number (char *line) {
+	char *sp, *end;
+	long long n;
+
+	if ((sp = strrchr(line, ' ')) == NULL)
+		return -1;
+
+	errno = 0;
+	n = strtoll(sp + 1, &end, 10);
+	if (errno != 0 || end == sp + 1 || *end != '\0' || n < 0)
+		return -1;
+
+	*sp = '\0';
+	return (off_t)n;
+}
+
+
+/* Parses one request line, "\r\n" may or may not have been removed yet.
+ * The line is modified: fileName points to the NUL terminated name inside it.
+ * File names may contain spaces, the numbers of GETR are taken from the end of the line.
+ * For VERS, version is the highest version supported by both sides.
+ * Returns the command, CMD_INVALID for an unknown or malformed request */
+
+int parseRequest (char *line, struct request *req) {
+	char *end;
+	long n;
+
+	line[strcspn(line, "\r\n")] = '\0';
+
+	req->fileName = NULL;
+	req->offset = 0;
+	req->length = 0;
+	req->expectedSize = 0;
+	req->expectedMtime = 0;
+	req->version = 0;
+
+	if (strncmp(line, "VERS ", 5) == 0) {
+		errno = 0;
+		n = strtol(line + 5, &end, 10);
+		if (errno != 0 || end == line + 5 || *end != '\0' || n < PROTO_V1)
+			return req->command = CMD_INVALID;
+		req->version = (n > PROTO_MAXVERSION) ? PROTO_MAXVERSION : n;	/* The client may speak a newer version */
+		return req->command = CMD_VERS;
+	}
+
+	if (strcmp(line, "STATS") == 0)
+		return req->command = CMD_STATS;
+
+	if (strncmp(line, "RESUME ", 7) == 0) {
+		req->command = CMD_RESUME;
+		req->fileName = line + 7;
+		if ((req->expectedMtime = cut_number(req->fileName)) < 0 ||
+		    (req->expectedSize = cut_number(req->fileName)) < 0 ||
+		    (req->offset = cut_number(req->fileName)) < 0)
+			req->command = CMD_INVALID;
+	} else if (strncmp(line, "GETR ", 5) == 0) {
+		req->command = CMD_GETR;
+		req->fileName = line + 5;
+		if ((req->length = cut_number(req->fileName)) < 0 ||
+		    (req->offset = cut_number(req->fileName)) < 0)
+			req->command = CMD_INVALID;
+	} else if (strncmp(line, "GET ", 4) == 0) {
+		req->command = CMD_GET;
+		req->fileName = line + 4;
+	} else
+		req->command = CMD_INVALID;
+
+	if (req->command != CMD_INVALID && req->fileName[0] == '\0')
+		req->command = CMD_INVALID;
+
+	return req->command;
+}
+
+
+/* Validates the range of a GETR against the size of the file.
+ * A range running past the end of file is cut at the end of file.
+ * RESUME is refused if the file has changed since the interrupted transfer.
+ * Returns 0 if the range can be served */
+
+int checkRange (struct request *req, int version, off_t fileSize, const struct timespec *fileMtime) {
+	long long mtime;
+
+	if (version == PROTO_V1 && fileSize > UINT32_MAX)
+		return 1;	/* Size does not fit in the header */
+
+	if (req->command == CMD_GET) {
+		req->offset = 0;
+		req->length = fileSize;
+		return 0;
+	}
+
+	if (req->command == CMD_RESUME) {
+		if (version == PROTO_V1)
+			mtime = (uint32_t)fileMtime->tv_sec;	/* Dates travel as 32 bits */
+		else
+			mtime = fileMtime->tv_sec * 1000000000LL + fileMtime->tv_nsec;
+		if (req->expectedSize != fileSize || req->expectedMtime != mtime)
+			return 1;
+		req->length = fileSize - req->offset;
+	}
+
+	if (req->offset > fileSize)
+		return 1;
+
+	if (req->length > fileSize - req->offset)
+		req->length = fileSize - req->offset;
+
+	return 0;
+}
+
+
+/* Writes "+OK\r\n" and the size fields of the response to req into buf (at least MAXHEADERLEN bytes).
+ * Returns the length of the header */
+
+int buildHeader (char *buf, int version, struct request *req, off_t fileSize) {
+	uint32_t v32;
+	uint64_t v64;
+	int len = 5;
+
+	memcpy(buf, "+OK\r\n", 5);
+
+	if (version == PROTO_V1) {
+		v32 = htonl((uint32_t)fileSize);
+		memcpy(buf + len, &v32, 4);
+		len += 4;
+		if (req->command != CMD_GET) {
+			v32 = htonl((uint32_t)req->length);
+			memcpy(buf + len, &v32, 4);
+			len += 4;
+		}
+	} else {
+		v64 = htobe64((uint64_t)fileSize);
+		memcpy(buf + len, &v64, 8);
+		len += 8;
+		if (req->command != CMD_GET) {
+			v64 = htobe64((uint64_t)req->length);
+			memcpy(buf + len, &v64, 8);
+			len += 8;
+		}
+	}
+
+	return len;
+}
+
+
+/* Writes the last modification that ends every response into buf (at least MAXTRAILERLEN bytes).
+ * Returns its length */
+
+int buildTrailer (char *buf, int version, const struct timespec *fileMtime) {
+	uint32_t v32;
+	uint64_t v64;
+
+	if (version == PROTO_V1) {
+		v32 = htonl((uint32_t)fileMtime->tv_sec);
+		memcpy(buf, &v32, 4);
+		return 4;
+	}
+
+	v64 = htobe64((uint64_t)fileMtime->tv_sec * 1000000000ULL + fileMtime->tv_nsec);
+	memcpy(buf, &v64, 8);
+	return 8;
+}
+
+
+/* Writes the answer to VERS into buf (VERSREPLYLEN bytes). Returns its length */
+
+int buildVersionReply (char *buf, int version) {
+	uint32_t v32 = htonl((uint32_t)version);
+
+	memcpy(buf, "+OK\r\n", 5);
+	memcpy(buf + 5, &v32, 4);
+	return VERSREPLYLEN;
+}
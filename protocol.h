@@ -0,0 +1,65 @@
+/*
+
+module: protocol.h
+
+purpose: definitions of functions in protocol.c
+
+*/
+
+#ifndef _PROTOCOL_H
+
+#define _PROTOCOL_H
+
+#include <sys/types.h>
+#include <time.h>
+
+#define CMD_INVALID	-1
+#define CMD_GET		0	/* "GET <file>\r\n" */
+#define CMD_GETR	1	/* "GETR <file> <offset> <length>\r\n" */
+#define CMD_RESUME	2	/* "RESUME <file> <offset> <size> <mtime>\r\n" */
+#define CMD_VERS	3	/* "VERS <version>\r\n" */
+#define CMD_STATS	4	/* "STATS\r\n" */
+
+#define PROTO_V1	1	/* Sizes in 32 bits, last modification in seconds (4 bytes) */
+#define PROTO_V2	2	/* Sizes in 64 bits, last modification in nanoseconds since the Epoch (8 bytes) */
+#define PROTO_MAXVERSION PROTO_V2
+
+#define MAXHEADERLEN	21	/* "+OK\r\n" and two 64 bit fields */
+#define MAXTRAILERLEN	8
+#define VERSREPLYLEN	9	/* "+OK\r\n" and the version */
+#define MAXSTATSLEN	4096	/* Response to STATS: "+OK\r\n", the text length (4) and the text, at most */
+
+/* Response to GET:  "+OK\r\n" | size (4) | content | last modification (4)
+ * Response to GETR: "+OK\r\n" | file size (4) | range length (4) | range | last modification (4)
+ * All integers are in network byte order. A GETR with length 0 only returns the header and the last modification.
+ * RESUME continues an interrupted transfer from offset to the end of file, only if the file still has the given
+ * size and last modification (as received before), otherwise "-ERR\r\n". Its response is the same as GETR.
+ *
+ * A connection speaks version 1 until the client sends "VERS <version>"; the server answers "+OK\r\n" | version (4)
+ * with the highest version both sides support. Servers without VERS answer "-ERR\r\n" and close the connection.
+ * In version 2 sizes and range lengths take 8 bytes and the last modification is in nanoseconds (8 bytes),
+ * also in RESUME requests. Version 1 refuses files of 4 GiB or more.
+ *
+ * STATS returns the metrics of the server, in any version: "+OK\r\n" | length (4) | text of "name value\n" lines. */
+
+struct request {
+	int	command;
+	char	*fileName;	/* Points into the parsed line */
+	off_t	offset;
+	off_t	length;
+	off_t	expectedSize;	/* RESUME only */
+	long long expectedMtime;	/* RESUME only, seconds or nanoseconds according to the version */
+	int	version;	/* VERS only */
+};
+
+int parseRequest (char *line, struct request *req);
+
+int checkRange (struct request *req, int version, off_t fileSize, const struct timespec *fileMtime);
+
+int buildHeader (char *buf, int version, struct request *req, off_t fileSize);
+
+int buildTrailer (char *buf, int version, const struct timespec *fileMtime);
+
+int buildVersionReply (char *buf, int version);
+
+#endif
@@ -0,0 +1,199 @@
+/*
+
+module: sched.c
+
+purpose: order in which the body chunks of concurrent transfers are sent, deficit round robin or shortest
+	 remaining bytes first.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sched.h"
+
+static int policy = SCHED_DRR;
+static size_t quantum = SCHED_QUANTUM;
+static int count;			/* Ready entries */
+static struct schedEntry *cursor;	/* DRR: next turn, the ring is walked from here */
+static struct schedEntry **heap;	/* SRPT: min-heap on remaining */
+static int heapSize;
+
+
+/* "drr" or "srpt", then optionally ":QUANTUM" (k, m suffixes). Returns 0 on success, -1 if spec is not valid */
+
+int schedConfigure (const char *spec) {
+	unsigned long long q = SCHED_QUANTUM;
+	size_t len = strcspn(spec, ":");
+	char *end;
+
+	if (spec[len] == ':') {
+		q = strtoull(spec + len + 1, &end, 10);
+		if (*end == 'k' || *end == 'K')
+			q *= 1024, end++;
+		else if (*end == 'm' || *end == 'M')
+			q *= 1024 * 1024, end++;
+		if (end == spec + len + 1 || *end != '\0' || q == 0)
+			return -1;
+	}
+
+	if (len == 3 && strncmp(spec, "drr", 3) == 0)
+		policy = SCHED_DRR;
+	else if (len == 4 && strncmp(spec, "srpt", 4) == 0)
+		policy = SCHED_SRPT;
+	else
+		return -1;
+
+	quantum = q;
+	return 0;
+}
+
+
+static void heapSwap (int i, int j) {
+	struct schedEntry *t = heap[i];
+
+	heap[i] = heap[j];
+	heap[j] = t;
+	heap[i]->index = i;
+	heap[j]->index = j;
+}
+
+static void siftUp (int i) {
+	while (i > 0 && heap[(i - 1) / 2]->remaining > heap[i]->remaining) {
+		heapSwap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void siftDown (int i) {
+	int child;
+
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= count)
+			return;
+		if (child + 1 < count && heap[child + 1]->remaining < heap[child]->remaining)
+			child++;
+		if (heap[i]->remaining <= heap[child]->remaining)
+			return;
+		heapSwap(i, child);
+		i = child;
+	}
+}
+
+
+/* A new transfer of e, which has not been ready yet */
+
+void schedStart (struct schedEntry *e) {
+	e->fresh = 1;
+}
+
+
+/* Makes e ready, if it is not already. Returns -1 if the heap can not grow */
+
+int schedReady (struct schedEntry *e, off_t remaining) {
+	struct schedEntry **h;
+
+	if (e->queued)
+		return 0;
+
+	e->deficit = 0;
+	e->remaining = remaining;
+
+	if (policy == SCHED_SRPT) {
+		if (count == heapSize) {
+			if ((h = realloc(heap, (heapSize ? 2 * heapSize : 64) * sizeof(*heap))) == NULL)
+				return -1;
+			heap = h;
+			heapSize = heapSize ? 2 * heapSize : 64;
+		}
+		heap[count] = e;
+		e->index = count++;
+		siftUp(e->index);
+	}
+	else {				/* Last of the round */
+		if (cursor == NULL) {
+			e->next = e->prev = e;
+			cursor = e;
+		}
+		else {
+			e->next = cursor;
+			e->prev = cursor->prev;
+			cursor->prev->next = e;
+			cursor->prev = e;
+			if (e->fresh)	/* First of the round instead, as a new flow of fq_codel */
+				cursor = e;
+		}
+		count++;
+	}
+
+	e->queued = 1;
+	e->fresh = 0;
+	return 0;
+}
+
+
+void schedRemove (struct schedEntry *e) {
+	int i;
+
+	if (!e->queued)
+		return;
+
+	if (policy == SCHED_SRPT) {
+		i = e->index;
+		if (i != --count) {
+			heapSwap(i, count);
+			siftUp(i);
+			siftDown(i);
+		}
+	}
+	else {
+		if (e->next == e)
+			cursor = NULL;
+		else {
+			if (cursor == e)
+				cursor = e->next;
+			e->prev->next = e->next;
+			e->next->prev = e->prev;
+		}
+		count--;
+	}
+
+	e->queued = 0;
+	e->deficit = 0;
+}
+
+
+/* Entry whose turn it is, NULL if none is ready. allowance: bytes it may send in this turn */
+
+struct schedEntry *schedNext (size_t *allowance) {
+	struct schedEntry *e;
+
+	if (count == 0)
+		return NULL;
+
+	if (policy == SCHED_SRPT) {
+		*allowance = quantum;	/* Then the heap is looked at again */
+		return heap[0];
+	}
+
+	e = cursor;
+	cursor = e->next;
+	e->deficit += quantum;
+	*allowance = e->deficit;
+	return e;
+}
+
+
+void schedCharge (struct schedEntry *e, size_t sent) {
+	e->remaining -= sent;
+	e->deficit = e->deficit > (long long)sent ? e->deficit - (long long)sent : 0;
+
+	if (policy == SCHED_SRPT && e->queued)
+		siftUp(e->index);	/* Only shorter */
+}
+
+
+int schedCount (void) {
+	return count;
+}
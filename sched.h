@@ -0,0 +1,53 @@
+/*
+
+module: sched.h
+
+purpose: definitions of functions in sched.c
+
+*/
+
+#ifndef _SCHED_H
+
+#define _SCHED_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define SCHED_DRR	0		/* Deficit round robin: every ready transfer gets a quantum per round */
+#define SCHED_SRPT	1		/* Shortest remaining bytes first: the transfer closest to its end gets the turn */
+
+#define SCHED_QUANTUM	(256*1024)	/* Default bytes per turn */
+
+struct schedEntry {			/* One per connection */
+	void	*data;			/* The connection, given back by schedNext() */
+	struct schedEntry *next, *prev;	/* DRR: ring of the ready entries */
+	int	index;			/* SRPT: position in the heap */
+	int	queued;
+	int	fresh;			/* DRR: started, not ready yet: its first turn comes before the round in course */
+	long long deficit;		/* DRR: bytes the entry may still send in this round */
+	off_t	remaining;		/* SRPT: body bytes left, the key of the heap */
+};
+
+/* A transfer with body bytes to send and a writable socket is made ready with schedReady(); the event loop then
+ * asks schedNext() whose turn it is and how many bytes the turn allows, and the transfer reports what it has sent
+ * with schedCharge(). A transfer whose socket is full, or which has ended, leaves with schedRemove(). With DRR
+ * the turns go round the ready transfers, each one sending about a quantum: a big file can not delay the others
+ * by more than a quantum per transfer, and a transfer announced with schedStart() has its first turn at once.
+ * With SRPT the mean completion time is the lowest, big files only go on when the smaller ones are blocked or done.
+ * The policy is chosen with schedConfigure("drr" or "srpt", optionally ":QUANTUM" with k or m suffix). */
+
+int schedConfigure (const char *spec);
+
+void schedStart (struct schedEntry *e);
+
+int schedReady (struct schedEntry *e, off_t remaining);
+
+void schedRemove (struct schedEntry *e);
+
+struct schedEntry *schedNext (size_t *allowance);
+
+void schedCharge (struct schedEntry *e, size_t sent);
+
+int schedCount (void);
+
+#endif
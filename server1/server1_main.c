@@ -1,22 +1,41 @@
 /*****  TCP SEQUENTIAL SERVER   *****/
 
+#define _GNU_SOURCE                                                         /* POLLRDHUP */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
 #include "../errlib.h"
 #include "../sockwrap.h"
+#include "../protocol.h"
+#include "../filecache.h"
+#include "../socktune.h"
+#include "../metrics.h"
+#include "../trace.h"
+#include "../progress.h"
+#include "../shaper.h"
 #include <fcntl.h>
 #include <signal.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <poll.h>
 #include <errno.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 /* CONSTANTS */
 
 #define BUFLEN 128                                                          /* Receiver Buffer length */
-#define MAXBUFLEN 1000                                                      /* Transmitter Buffer Length */
 #define TIMEOUT 15                                                          /* timeout is 15 seconds */
 #define TRANSFER_APPROVAL 0                                                 /* If you want to activate the approval mechanism for every single transfer, set this constant 1 */
+#define FILE_CACHE_SIZE 1024                                                /* Open files kept with their size and last modification, a hit costs no system call */
+#define CONTENT_CACHE_BUDGET (64*1024*1024)                                 /* Bytes of small files kept in memory, a hit is sent with one writev() */
+#define USE_SENDFILE 1                                                      /* File content is sent with sendfile() (page cache --> socket, no user space copy). Set this constant 0 to use fread()/send() loop */
+#define USE_MMAP_ZEROCOPY 0                                                 /* File content is sent from a memory mapping with MSG_ZEROCOPY (no copy, even where sendfile() can not be used). Set this constant 1 to use it instead of sendfile() */
+#define MAPPING_WINDOW (64*1024*1024)                                       /* MSG_ZEROCOPY mode: bytes of the file mapped and sent at a time */
+#define HUGE_PAGE_SIZE (2*1024*1024)                                        /* MSG_ZEROCOPY mode: windows are aligned on huge pages, so that they can be backed by them */
 
 /* FUNCTION PROTOTYPES */
 
@@ -26,10 +45,15 @@ int fstat(int fildes, struct stat *buf);
 /* GLOBAL VARIABLES */
 
 struct  timeval tval;
-struct  stat fileStat;
 char    *prog_name;
 char    ackMsg[5] = "+OK\r\n";
 int     socketAbnormalTermination;
+int     tuneProfile = TUNE_NONE;                                            /* -t: socket options and buffer sizing, inherited by the accepted sockets */
+size_t  chunkOption = 0;                                                    /* -b: bytes per pread()/send() when sendfile() is not used, 0 to adapt them */
+int     cacheFd = -1;                                                       /* inotify descriptor of the file cache, -1 if files are checked at every lookup */
+int     logLevel = LOG_INFO;                                                /* -L: less important messages are discarded */
+uint64_t traceConn;                                                         /* -T: connection being served, for traceEvent() */
+struct  shaper connShaper;                                                  /* -S: bandwidth limits of the connection being served */
 
 
 void setPromptColor(char *colorName)
@@ -54,10 +78,9 @@ void sigPipeHandler(int signal)
 {
     if(signal == SIGPIPE)
     {
-        setPromptColor("red");
-        printf("\rTransfer Failure! Socket has been closed!\n");
-        setPromptColor("default");
+        err_log(LOG_WARNING, "Transfer Failure! Socket has been closed!");
         socketAbnormalTermination = 1;
+        metricsAdd(METRIC_ABORTS, 1);
     }
 }
 
@@ -75,180 +98,420 @@ void sendErrorMessage(int socket)
 {
     char msgError[6] = "-ERR\r\n";
 
-    size_t msgLen = strlen(msgError);
+    size_t msgLen = sizeof(msgError);                                               /* msgError is not NUL terminated */
+
+    metricsAdd(METRIC_ERRORS, 1);
 
     if( writen(socket, msgError, msgLen) == msgLen )
     {
-        setPromptColor("green");
-        printf("Error message has been successfully sent!\n");
-        setPromptColor("default");
+        err_log(LOG_INFO, "Error message has been successfully sent!");
     }
     else
     {
-        setPromptColor("red");
-        printf("Error message failure!\n");
-        setPromptColor("default");
+        err_log(LOG_WARNING, "Error message failure!");
     }
 }
 
-char *getRequestedFileName(char *msg)
+/* Maps mapLen bytes of the file from mapOffset (a multiple of HUGE_PAGE_SIZE), at an address aligned on a huge page
+   if the window is big enough: file offset and address are then congruent, as transparent huge pages require.
+   Returns NULL on error */
+char *mapWindow(int fileDesc, off_t mapOffset, size_t mapLen)
 {
-    char *tmp = NULL;
-    tmp = memchr(msg, ' ', strlen(msg));
-    tmp += 1;
-    return tmp;
+    size_t  pageLen = (mapLen + sysconf(_SC_PAGESIZE) - 1) & ~(size_t)(sysconf(_SC_PAGESIZE) - 1);
+    char    *area, *aligned, *map;
+
+    if(mapLen < HUGE_PAGE_SIZE)
+    {
+        map = mmap(NULL, mapLen, PROT_READ, MAP_SHARED, fileDesc, mapOffset);
+        return map == MAP_FAILED ? NULL : map;
+    }
+
+    area = mmap(NULL, pageLen + HUGE_PAGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);   /* Address space to choose an aligned address from */
+    if(area == MAP_FAILED)
+        return NULL;
+
+    aligned = (char *)(((uintptr_t)area + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+
+    if((map = mmap(aligned, mapLen, PROT_READ, MAP_SHARED | MAP_FIXED, fileDesc, mapOffset)) == MAP_FAILED)
+    {
+        munmap(area, pageLen + HUGE_PAGE_SIZE);
+        return NULL;
+    }
+
+    if(aligned > area)                                                              /* Release the address space around the mapping */
+        munmap(area, aligned - area);
+    if(aligned + pageLen < area + pageLen + HUGE_PAGE_SIZE)
+        munmap(aligned + pageLen, area + HUGE_PAGE_SIZE - aligned);
+
+#ifdef MADV_HUGEPAGE
+    madvise(map, mapLen, MADV_HUGEPAGE);                                            /* Only honoured by file systems that support huge pages in the page cache */
+#endif
+    return map;
 }
 
-int getFileStats(char *fileName)
+/* Returns how many of want bytes the shaper lets go now, 0 if the client has gone meanwhile.
+   A throttled connection waits in poll() for the refill, which also ends as soon as the client hangs up */
+size_t shapeChunk(int socket, size_t want)
 {
-    int res = open(fileName, O_RDONLY);
+    size_t  grant;
+    struct  pollfd pfd;
 
-    if(fstat(res, &fileStat) < 0)
+    while((grant = shaperGrant(&connShaper, want)) == 0)
     {
-        setPromptColor("red");
-        perror("Error in fstat");
-        setPromptColor("default");
-        return 1;
+        pfd.fd      = socket;
+        pfd.events  = POLLRDHUP;
+
+        if(poll(&pfd, 1, (int)(shaperDelay(&connShaper, want) * 1000) + 1) > 0 || socketAbnormalTermination == 1)
+            return 0;
+    }
+
+    return grant;
+}
+
+/* Sends length bytes of the file from offset straight from the page cache with MSG_ZEROCOPY, one window at a time:
+   unlike sendfile() it works on any file that can be mapped, and the mapping can be framed with writev() */
+int sendMappedContent(int fileDesc, int socket, off_t offset, off_t length)
+{
+    off_t   sent = 0, mapOffset;
+    size_t  skip, len;
+    char    *map;
+    int     result;
+
+    while(sent < length)
+    {
+        mapOffset = (offset + sent) & ~(off_t)(HUGE_PAGE_SIZE - 1);                 /* Page aligned as mmap() requires, huge page aligned as the address */
+        skip      = offset + sent - mapOffset;
+        len       = (length - sent < (off_t)(MAPPING_WINDOW - skip)) ? length - sent : MAPPING_WINDOW - skip;
+
+        if((len = shapeChunk(socket, len)) == 0)                                   /* Smaller windows while throttled */
+            return 1;
+
+        if(socketAbnormalTermination == 1 || (map = mapWindow(fileDesc, mapOffset, skip + len)) == NULL)
+            return 1;
+
+        madvise(map, skip + len, MADV_SEQUENTIAL);                                  /* Pages behind are not needed again */
+        madvise(map + skip, len, MADV_WILLNEED);                                    /* Start reading the whole window now */
+
+        result = sendZerocopy(socket, map + skip, len) != len;                      /* Fails with EFAULT, not SIGBUS, if the file has been truncated */
+        munmap(map, skip + len);
+
+        if(result)
+            return 1;
+
+        if(sent == 0)
+            traceEvent(traceConn, TRACE_FIRST_BYTE, len);
+
+        sent += len;
+
+        shaperCharge(&connShaper, len);
+        progressAdd(len);
     }
-    close(res);
 
     return 0;
 }
 
-int transferFile(char *fileName, int socket)
+/* Sends fileSize bytes of the file from offset with pread() and send(), in chunks sized by -b */
+int sendCopiedContent(int fileDesc, int socket, off_t offset, off_t fileSize)
 {
-    uint32_t fSize = 0;
-    uint32_t fLastMod = 0;
-    FILE    *fptr = NULL;
+    off_t   transmittedSize = 0;
+    size_t  newLen;
     char    *tbuf;
-    size_t  newLen = 0;
-    long    tmpFileSize;
-    long    transmittedSize = 0;
-    int     n;
+    ssize_t n;
+    struct  chunkSizer chunk;
+    struct  socketTuner tuner;
 
-    tbuf = malloc(MAXBUFLEN * (sizeof *tbuf));
+    tunerInit(&tuner, socket, tuneProfile, 1);
+    chunkInit(&chunk, chunkOption);
 
-    signal(SIGPIPE, sigPipeHandler);
-
-    fileName = strtok(fileName, "\r");                                              /* "fileName.txt\r\n" --> "fileName.txt" */
+    if((tbuf = chunkBuffer(&chunk, fileSize)) == NULL)
+        return 1;
 
-    if((fptr = fopen(fileName, "rb")) == NULL)
+    while(transmittedSize < fileSize)
     {
-        setPromptColor("red");
-        fprintf(stderr," An error occured while opening %s\n", fileName);
-        setPromptColor("default");
-        return 1;
+        if((newLen = shapeChunk(socket, (fileSize - transmittedSize < (off_t)chunk.size) ? fileSize - transmittedSize : chunk.size)) == 0)
+        {
+            free(tbuf);
+            return 1;
+        }
+
+        n = pread(fileDesc, tbuf, newLen, offset + transmittedSize);
+
+        if(n <= 0)
+        {
+            err_log(LOG_WARNING, "Error in reading file");
+            free(tbuf);
+            return 1;
+        }
+
+        newLen = n;
+
+        if(socketAbnormalTermination == 1 || sendn(socket, tbuf, newLen, 0) != newLen)
+        {
+            free(tbuf);
+            return 1;
+        }
+
+        if(transmittedSize == 0)
+            traceEvent(traceConn, TRACE_FIRST_BYTE, newLen);
+
+        transmittedSize += newLen;
+
+        shaperCharge(&connShaper, newLen);
+        chunkUpdate(&chunk, socket, newLen, 1);                                     /* Bigger chunks while they make the copy faster */
+        tunerUpdate(&tuner, socket, newLen);
+        progressAdd(newLen);
     }
 
-    if(getFileStats(fileName) == 0)
+    free(tbuf);
+    tunerEnd(&tuner, socket);
+    return 0;
+}
+
+#if USE_SENDFILE && defined(__linux__)
+/* Sends fileSize bytes of the file from offset with sendfile(), page cache --> socket with no user space copy.
+   A file that sendfile() can not read is sent by sendCopiedContent() */
+int sendKernelContent(int fileDesc, int socket, off_t offset, off_t fileSize)
+{
+    off_t   transmittedSize = 0;
+    ssize_t n;
+    struct  socketTuner tuner;
+    off_t   count;
+
+    tunerInit(&tuner, socket, tuneProfile, 1);
+
+    while(transmittedSize < fileSize)                                               /* sendfile() may send less than requested (e.g. 2GB limit per call), so loop until everything is sent */
     {
-        fSize       = htonl((uint32_t)fileStat.st_size);
-        fLastMod    = htonl((uint32_t)fileStat.st_mtime);
+        if(socketAbnormalTermination == 1)
+            return 1;
+
+        count = fileSize - transmittedSize;
+        if((size_t)count > tunerLimit(&tuner))                                      /* Stop at the next TCP_INFO sample */
+            count = tunerLimit(&tuner);
+        if(transmittedSize == 0 && count > CHUNK_MIN)                               /* A small first call, so that TRACE_FIRST_BYTE is not the whole file */
+            count = CHUNK_MIN;
+
+        if((count = shapeChunk(socket, count)) == 0)                                /* -S: no more than the tokens of the connection */
+            return 1;
+
+        n = sendfile(socket, fileDesc, &offset, count);                             /* File position is not used, the descriptor is shared by the cache */
+
+        if(n < 0)
+        {
+            if(INTERRUPTED_BY_SIGNAL)
+                continue;
+
+            if(transmittedSize == 0 && (errno == EINVAL || errno == ENOSYS))        /* sendfile() is not supported for this file, use the copy loop instead */
+                break;
+
+            return 1;
+        }
+        else if(n == 0)                                                             /* File has been truncated after fstat() */
+            return 1;
+
+        if(transmittedSize == 0)
+            traceEvent(traceConn, TRACE_FIRST_BYTE, n);
+
+        transmittedSize += n;
+
+        shaperCharge(&connShaper, n);
+        tunerUpdate(&tuner, socket, n);                                             /* Send buffer sized to the measured bandwidth-delay product */
+        progressAdd(n);                                                             /* Drawn by the reporter thread, not here */
     }
-    else
-        return 1;
 
-    if(socketAbnormalTermination == 1)
-        return 1;
+    if(transmittedSize < fileSize)
+        return sendCopiedContent(fileDesc, socket, offset, fileSize);
 
-    if(writen(socket, ackMsg, strlen(ackMsg)) != strlen(ackMsg))
-        return 1;
+    tunerEnd(&tuner, socket);
+    return 0;
+}
+#endif
 
-    if(writen(socket, &fSize, sizeof(uint32_t)) != sizeof(uint32_t))
-        return 1;
+int sendFileContent(int fileDesc, int socket, off_t offset, off_t fileSize)
+{
+    traceEvent(traceConn, TRACE_BODY, fileSize);
+#if USE_MMAP_ZEROCOPY
+    return sendMappedContent(fileDesc, socket, offset, fileSize);
+#elif USE_SENDFILE && defined(__linux__)
+    return sendKernelContent(fileDesc, socket, offset, fileSize);
+#else
+    return sendCopiedContent(fileDesc, socket, offset, fileSize);
+#endif
+}
+
+int transferFile(struct request *req, int socket, int version)
+{
+    struct  cachedFile *file;
+    char    header[MAXHEADERLEN];                                           /* "+OK\r\n" and sizes, 32 or 64 bits according to the version */
+    char    trailer[MAXTRAILERLEN];                                         /* Last modification, seconds or nanoseconds according to the version */
+    int     headerLen, trailerLen;
+    int     result = 0;
+    char    *content;
+    struct  iovec iov[3];
+    ssize_t total;
+
+    signal(SIGPIPE, sigPipeHandler);
 
-    tmpFileSize = fileStat.st_size;
+    traceEvent(traceConn, TRACE_OPEN, 0);
 
-    if(tmpFileSize <= MAXBUFLEN)
+    if((file = fileCacheOpen(req->fileName)) == NULL)                       /* Open descriptor and stats, from the cache if the file has not changed */
     {
-        newLen = fread(tbuf, sizeof(char), MAXBUFLEN, fptr);
+        err_log(LOG_WARNING, "An error occured while opening %s", req->fileName);
+        return 1;
+    }
 
-        if (ferror(fptr) != 0)
+    if(checkRange(req, version, file->size, &file->mtime) != 0)            /* GET sends the whole file, GETR/RESUME only a range */
+    {
+        fileCacheRelease(file);
+        return 1;
+    }
+
+    if((content = fileCacheContent(file)) != NULL)                          /* Small file in memory: header, content and last modification in one writev() */
+    {
+        if(req->command == CMD_GET)                                         /* Pre-serialized */
         {
-            setPromptColor("red");
-            fputs("Error in reading file", stderr);
-            setPromptColor("default");
-            return 1;
+            iov[0].iov_base = file->header[version - 1];
+            iov[0].iov_len  = file->headerLen[version - 1];
         }
         else
         {
-            tbuf[newLen++] = '\0';
+            iov[0].iov_base = header;
+            iov[0].iov_len  = buildHeader(header, version, req, file->size);
+        }
+        iov[1].iov_base = content + req->offset;
+        iov[1].iov_len  = req->length;
+        iov[2].iov_base = file->trailer[version - 1];
+        iov[2].iov_len  = file->trailerLen[version - 1];
 
-            if(socketAbnormalTermination == 1)
-                return 1;
+        total = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;              /* writevn() modifies iov */
 
-            if(send(socket, tbuf, strlen(tbuf), 0) != strlen(tbuf))
-                return 1;
-        }
+        traceEvent(traceConn, TRACE_BODY, req->length);
+
+        if(socketAbnormalTermination == 1 || (req->length > 0 && shapeChunk(socket, req->length) == 0) || writevn(socket, iov, 3) != total)
+            result = 1;
+        else
+            shaperCharge(&connShaper, req->length);                         /* Sent whole once the first quantum is there, the debt delays the next request */
+
+        fileCacheRelease(file);
+        return result;
     }
+
+    headerLen   = buildHeader(header, version, req, file->size);
+    trailerLen  = buildTrailer(trailer, version, &file->mtime);
+
+    traceEvent(traceConn, TRACE_HEADER, headerLen);
+
+    tcpCork(socket, 1);                                                         /* Header, content and trailer leave as full segments, a small file in one train */
+    progressStart("SENDING", req->length);
+
+    if(socketAbnormalTermination == 1 ||
+       writen(socket, header, headerLen) != headerLen ||
+       sendFileContent(file->fd, socket, req->offset, req->length) != 0)
+        result = 1;
     else
     {
-        setPromptColor("cyan");
+        traceEvent(traceConn, TRACE_DRAIN, req->length);
 
-        while(tmpFileSize > 0)
-        {
-            newLen = fread(tbuf, sizeof(char), MAXBUFLEN, fptr);
+        if(writen(socket, trailer, trailerLen) != trailerLen)
+            result = 1;
+    }
 
-            if (ferror(fptr) != 0)
-            {
-                setPromptColor("red");
-                fputs("Error in reading file", stderr);
-                setPromptColor("default");
-                return 1;
-            }
-            else
-            {
-                tbuf[newLen++] = '\0';
-                n = send(socket, tbuf, MAXBUFLEN, 0);
-            }
+    tcpCork(socket, 0);                                                         /* Push the last segment now, not after the client's delayed ACK */
+    progressEnd();
 
-            if(n == -1)
-                break;
+    fileCacheRelease(file);
+    return result;
+}
 
-            transmittedSize += n;
-            tmpFileSize     -= n;
+void printCacheStats(void)
+{
+    struct  cacheStats st;
 
-            printf("\rSENDING: %c%ld", '%', (transmittedSize*100/(long)fileStat.st_size));
-            fflush(stdout);
-        }
+    fileCacheStats(&st);
 
-        setPromptColor("default");
-    }
+    err_log(LOG_INFO, "File cache: %d open files, %zu bytes of content, %lu hits, %lu misses, %lu evictions, %lu invalidations",
+            st.files, st.bytes, st.hits, st.misses, st.evictions, st.invalidations);
+}
 
-    if(writen(socket, &fLastMod, sizeof(uint32_t)) != sizeof(uint32_t))
-        return 1;
+/* Waits until the socket is readable (or writable) as select() did before, changed files are meanwhile dropped from the cache.
+   Returns as select() */
+int waitSocket(int s, int forWrite)
+{
+    fd_set  rset, wset;
+    struct  timeval tv = tval;                                                  /* select() modifies the timeout */
+    int     n;
 
-    strcpy(tbuf, "");
-    fclose(fptr);
-    free(tbuf);
-    return 0;
+    for (;;)
+    {
+        FD_ZERO(&rset);
+        FD_ZERO(&wset);
+        FD_SET(s, forWrite ? &wset : &rset);
+        if(cacheFd != -1)
+            FD_SET(cacheFd, &rset);
+
+        if((n = select(FD_SETSIZE, &rset, &wset, NULL, &tv)) <= 0)
+            return n;
+
+        if(cacheFd == -1 || !FD_ISSET(cacheFd, &rset))
+            return n;
+
+        fileCacheInvalidate();
+
+        if(n > 1)                                                               /* Socket is ready too */
+            return n - 1;
+    }
 }
 
 void service(int s)
 {
-    char	rbuf[BUFLEN];		                                                /* Receiver buffer */
+    char	rbuf[BUFLEN];		                                                /* Receiver buffer, it may hold several pipelined requests */
+    struct  request req;
+    char    *end;
     int     n;
-    size_t  m;
-    fd_set  set;
-    FD_ZERO(&set);
-    FD_SET(s, &set);
+    int     m;
+    size_t  rlen = 0;                                                           /* Bytes received and not served yet */
+    size_t  reqLen;
+    int     version = PROTO_V1;                                                 /* Until the client sends VERS */
+    char    versReply[VERSREPLYLEN];
+    char    *stats;
+    size_t  statsLen;
+    double  start;
+
+    metricsAdd(METRIC_CONNECTIONS, 1);
+    metricsAdd(METRIC_ACTIVE, 1);
 
     for (;;)
     {
-        m = select(FD_SETSIZE, &set, NULL, NULL, &tval);
-
-        if(m > 0)
+        if((end = memchr(rbuf, '\n', rlen)) == NULL)                            /* No whole request in rbuf yet, receive more bytes */
         {
+            if(rlen == BUFLEN-1)                                                /* Request is too long */
+            {
+                sendErrorMessage(s);
+                close(s);
+                break;
+            }
+
+            traceEvent(traceConn, TRACE_WAIT, rlen);
+
+            m = waitSocket(s, 0);
+
+            if(m <= 0)
+            {
+                err_log(LOG_WARNING, "Timeout has expired on socket %03d!", s);
+                metricsAdd(METRIC_TIMEOUTS, 1);
+
+                sendErrorMessage(s);
+                close(s);
+                break;
+            }
+
             if(socketAbnormalTermination == 1)
                 break;
 
-            n = recv(s, rbuf, BUFLEN-1, 0);
+            n = recv(s, rbuf + rlen, BUFLEN-1-rlen, 0);
 
             if (n < 0)                                                          /* In case of only one of the each sides calls reset() in order to close the connection */
             {
-                setPromptColor("red");
-                printf("Read error! Connection is being terminated\n");
-                setPromptColor("default");
+                err_log(LOG_WARNING, "Read error! Connection is being terminated");
 
                 sendErrorMessage(s);
 
@@ -260,83 +523,121 @@ void service(int s)
                 close(s);
                 break;
             }
+
+            rlen += n;
+            continue;
+        }
+
+        *end = '\0';                                                            /* "GET fileName.txt\r\n" --> "GET fileName.txt\r", next request starts after it */
+        reqLen = end - rbuf + 1;
+
+        traceEvent(traceConn, TRACE_REQUEST, reqLen);
+
+        err_log(LOG_INFO, "Received data from socket %03d: %s", s, rbuf);
+
+        metricsAdd(METRIC_REQUESTS, 1);
+        start = metricsClock();
+
+        if(parseRequest(rbuf, &req) == CMD_INVALID)                             /* "GET <fileName>", "GETR <fileName> <offset> <length>" or "RESUME ..." */
+        {
+            err_log(LOG_WARNING, "Invalid request! Connection is being terminated");
+
+            sendErrorMessage(s);
+            close(s);
+            break;
+        }
+
+        if(req.command == CMD_VERS)                                             /* Protocol negotiation, the answer is "+OK\r\n" and the chosen version */
+        {
+            version = req.version;
+
+            if(writen(s, versReply, buildVersionReply(versReply, version)) != VERSREPLYLEN)
+            {
+                close(s);
+                break;
+            }
+
+            memmove(rbuf, rbuf + reqLen, rlen - reqLen);
+            rlen -= reqLen;
+            continue;
+        }
+
+        if(req.command == CMD_STATS)                                            /* Metrics of the server */
+        {
+            if((stats = buildStatsReply(&statsLen)) == NULL || writen(s, stats, statsLen) != statsLen)
+            {
+                free(stats);
+                close(s);
+                break;
+            }
+            free(stats);
+
+            memmove(rbuf, rbuf + reqLen, rlen - reqLen);
+            rlen -= reqLen;
+            continue;
+        }
+
+        if(TRANSFER_APPROVAL == 1)                                              /* If you want to activate the approval mechanism for every single transfer, set this constant 0 above. */
+        {
+            printf("Do you approve the transfer of ");		                    /* Approval mechanism for transfer request. If client does not press ENTER in 15 seconds, connection is get aborted */
+            printf("%s", req.fileName);
+            printf(" to the client? ( Press ENTER )\n");
+            signal(SIGALRM, timeoutHandler);
+            alarm(15);
+            while(1)
+            {
+                if(getchar() == '\n' || getchar() == EOF)
+                    break;
+            }
+            Signal(SIGALRM, SIG_IGN);
+            printf("File transfer request has been approved!\n");
+        }
+
+        traceEvent(traceConn, TRACE_WAIT_SEND, 0);
+
+        m = waitSocket(s, 1);
+
+        if(m > 0)
+        {
+            if(socketAbnormalTermination == 1)
+                break;
+
+            if( transferFile(&req, s, version) == 0 )
+            {
+                metricsAdd(METRIC_BYTES, req.length);
+                metricsLatency(req.length, metricsClock() - start);
+                traceEvent(traceConn, TRACE_DONE, req.length);
+
+                err_log(LOG_NOTICE, "%s has been successfully transferred on socket %03d!", req.fileName, s);
+
+                memmove(rbuf, rbuf + reqLen, rlen - reqLen);                    /* Keep the following pipelined requests */
+                rlen -= reqLen;
+            }
             else
             {
-                setPromptColor("green");
-                printf("\n\nReceived data from socket %03d :\n", s);
-                printf("\rReceived message is: %s\n", rbuf);
-                setPromptColor("default");
-
-                if(TRANSFER_APPROVAL == 1)                                      /* If you want to activate the approval mechanism for every single transfer, set this constant 0 above. */
-                {
-                    printf("Do you approve the transfer of ");		            /* Approval mechanism for transfer request. If client does not press ENTER in 15 seconds, connection is get aborted */
-                    printf("%s", getRequestedFileName(rbuf));
-                    printf("to the client? ( Press ENTER )\n");
-                    signal(SIGALRM, timeoutHandler);
-                    alarm(15);
-                    while(1)
-                    {
-                        if(getchar() == '\n' || getchar() == EOF)
-                            break;
-                    }
-                    Signal(SIGALRM, SIG_IGN);
-                    printf("File transfer request has been approved!\n");
-                }
-
-                m = select(FD_SETSIZE, NULL, &set, NULL, &tval);
-
-                if(m > 0)
-                {
-                    if(socketAbnormalTermination == 1)
-                        break;
-
-                    if( transferFile(getRequestedFileName(rbuf), s) == 0 )
-                    {
-                        setPromptColor("green");
-                        printf("\n\n<==================================================>\n");
-                        printf("\r%s has been successfully transferred!", getRequestedFileName(rbuf));
-                        printf("\n<==================================================>");
-                        setPromptColor("default");
-
-                        strcpy(rbuf, "");
-                    }
-                    else
-                    {
-                        setPromptColor("red");
-                        printf("Transfer failure! Connection is being terminated\n");
-                        setPromptColor("default");
-
-                        if(socketAbnormalTermination == 1)
-                            break;
-
-                        sendErrorMessage(s);
-                        close(s);
-                        break;
-                    }
-                }
-                else
-                {
-                    setPromptColor("red");
-                    printf("Timeout has expired!\n");
-                    setPromptColor("default");
-
-                    sendErrorMessage(s);
-                    close(s);
+                err_log(LOG_WARNING, "Transfer failure! Connection is being terminated");
+
+                if(socketAbnormalTermination == 1)
                     break;
-                }
+
+                sendErrorMessage(s);
+                close(s);
+                break;
             }
         }
         else
         {
-            setPromptColor("red");
-            printf("Timeout has expired!\n");
-            setPromptColor("default");
+            err_log(LOG_WARNING, "Timeout has expired on socket %03d!", s);
+            metricsAdd(METRIC_TIMEOUTS, 1);
 
             sendErrorMessage(s);
             close(s);
             break;
         }
     }
+
+    metricsAdd(METRIC_ACTIVE, -1);
+    traceEvent(traceConn, TRACE_CLOSE, 0);
 }
 
 int main (int argc, char *argv[])
@@ -347,16 +648,52 @@ int main (int argc, char *argv[])
     int	 	    s;			                                                        /* connected socket */
     socklen_t 	addrlen;
     struct      sockaddr_in saddr, caddr, sladdr, sraddr;	                        /* server and client addresses */
+    int         opt;
 
     tval.tv_sec = TIMEOUT;                                                          /* Timeout for any client connection after the server has been initiated */
     tval.tv_usec = 0;
 
     prog_name = argv[0];
 
+    while ((opt = getopt(argc, argv, "b:t:T:L:S:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'b':                                                               /* Chunk size of the copy loop: "auto" or bytes (k, m suffixes) */
+                if((chunkOption = parseChunkSize(optarg)) == (size_t)-1)
+                    goto usage;
+                break;
+            case 't':                                                               /* Socket tuning profile, the chosen values are logged */
+                if((tuneProfile = tuneProfileByName(optarg)) == TUNE_NONE)
+                    goto usage;
+                break;
+            case 'T':                                                               /* Phases of each connection are traced in the file <prefix>.<pid> */
+                if(traceInit(optarg, argv[0]) != 0)
+                    goto usage;
+                break;
+            case 'L':                                                               /* Least important messages shown: err, warning, notice, info (default) or debug */
+                if((logLevel = err_level_by_name(optarg)) == -1)
+                    goto usage;
+                break;
+            case 'S':                                                               /* Bandwidth limit, repeatable: conn=RATE[:BURST], global=RATE[:BURST] or A.B.C.D/N=RATE[:BURST] */
+                if(shaperConfigure(optarg) != 0)
+                    goto usage;
+                break;
+            default:
+            usage:                                                                  /* Unknown option or invalid value */
+                setPromptColor("red");
+                printf("Usage: ./server1_main [-b auto|<chunk size>] [-t lan|wan|latency] [-T trace prefix] [-L log level] [-S limit]... <port number>\n");
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    argc -= optind - 1;                                                             /* From now on argv[1] is the port number as before */
+    argv += optind - 1;
+
     if (argc != 2)                                                                  /* To verify correctness of the arguments */
     {
         setPromptColor("red");
-        printf("Invalid amount of arguments!\n Usage: ./server1_main <port number>\n");
+        printf("Invalid amount of arguments!\n Usage: ./server1_main [-b auto|<chunk size>] [-t lan|wan|latency] [-T trace prefix] [-L log level] [-S limit]... <port number>\n");
         exit(EXIT_FAILURE);
     }
 
@@ -368,6 +705,13 @@ int main (int argc, char *argv[])
 
     lport_n = htons(lport_h);
 
+    err_async(logLevel);                                                            /* Messages are written by a background thread, a slow terminal does not stall the transfers */
+
+    metricsInit();
+
+    if(shaperInit() != 0)
+        err_sys("(%s) error - shaperInit() failed", prog_name);
+
     /* Socket Creation */
     setPromptColor("cyan");
     printf("\nCreating socket...\n");
@@ -392,6 +736,7 @@ int main (int argc, char *argv[])
     /* Listening the socket */
     setPromptColor("cyan");
     printf ("Listening at socket %d with backlog = %d\n",s,bklog);
+    tuneSocket(s, tuneProfile);                                                     /* Before listen(): accepted sockets inherit the options */
     Listen(s, bklog);                                                               /* Generic socket becomes a passive socket */
     setPromptColor("green");
     printf("Done\n");
@@ -399,6 +744,10 @@ int main (int argc, char *argv[])
 
     conn_request_skt = s;
 
+    cacheFd = fileCacheInit(FILE_CACHE_SIZE, CONTENT_CACHE_BUDGET);
+
+    progressInit();                                                                 /* Only if stdout is a terminal */
+
     for (;;)                                                                        /* Main server loop  this part, server should never stop */
     {
         fd_set cset;
@@ -407,24 +756,20 @@ int main (int argc, char *argv[])
 
         addrlen = sizeof(struct sockaddr_in);                                       /* Accepting next connection.*/
 
-        setPromptColor("cyan");
-        printf("\n<==========================>\n");
-        printf("Waiting for a new connection...\n");
-        printf("<==========================>\n\n");
-        setPromptColor("default");
+        err_log(LOG_INFO, "Waiting for a new connection...");
 
         s = Accept(conn_request_skt, (struct sockaddr *) &caddr, &addrlen);         /*  Every time "Accept" is called, a new socket is created (Socket for each client)
                                                                                         Server calls "accept" and "accept" blocks because there is no request in the queue at the moment.
                                                                                         Server can call "accept" even if there are no connection requests. As soon as request comes, if it is possible, server accepts it. */
         socketAbnormalTermination = 0;
+        traceConn = traceConnection(s);
+        traceEvent(traceConn, TRACE_CONNECT, 0);
+        shaperStart(&connShaper, caddr.sin_addr);                                   /* Rate of the most specific -S rule for the client */
 
-        setPromptColor("green");
-        printf("<=========================================>\n");
-        showAddr("Accepted connection from: ", &caddr);
-        printf("New socket: %u\n",s);
-        printf("<=========================================>\n\n");
-        setPromptColor("default");
+        err_log(LOG_INFO, "Accepted connection from %s:%u, new socket: %u", inet_ntoa(caddr.sin_addr), ntohs(caddr.sin_port), s);
 
         service(s);                                                                 /* Serving the client on socket s */
+
+        printCacheStats();
     }
 }
@@ -0,0 +1,799 @@
+/*****  TCP EVENT-DRIVEN SERVER (epoll)   *****/
+
+#define _GNU_SOURCE                                                         /* accept4() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include "../errlib.h"
+#include "../sockwrap.h"
+#include "../protocol.h"
+#include "../filecache.h"
+#include "../socktune.h"
+#include "../metrics.h"
+#include "../shaper.h"
+#include "../sched.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <errno.h>
+
+/* CONSTANTS */
+
+#define BUFLEN 128                                                          /* Receiver Buffer length */
+#define TIMEOUT 15                                                          /* An idle connection is closed after 15 seconds */
+#define MAXEVENTS 1024                                                      /* Maximum number of events returned by one epoll_wait() */
+#define BACKLOG 1024                                                        /* Maximum length of pending requests queue */
+#define FILE_CACHE_SIZE 1024                                                /* Open files kept with their size and last modification, a hit costs no system call */
+#define CONTENT_CACHE_BUDGET (64*1024*1024)                                 /* Bytes of small files kept in memory, a hit is sent with one writev() */
+
+/* CONNECTION STATES */
+
+#define READING_REQUEST 0                                                   /* Waiting for "GET <fileName>\r\n" */
+#define SENDING_HEADER  1                                                   /* Sending "+OK\r\n" and file size */
+#define SENDING_BODY    2                                                   /* Sending file content with sendfile(), in the turns given by the scheduler */
+#define SENDING_MTIME   3                                                   /* Sending last modification date */
+#define SENDING_VERSION 4                                                   /* Sending the answer to VERS */
+#define SENDING_CACHED  5                                                   /* Sending header, content from memory and last modification together */
+#define SENDING_STATS   6                                                   /* Sending the answer to STATS */
+
+/* DATA TYPES */
+
+struct connection
+{
+    int     socket;
+    int     state;
+    char    rbuf[BUFLEN];                                                   /* Request bytes received so far */
+    size_t  rlen;
+    char    fileName[BUFLEN];
+    struct  cachedFile *file;                                               /* File being sent, a reference to the file cache */
+    char    *content;                                                       /* Content of file in memory, NULL if it is sent with sendfile() */
+    off_t   offset;                                                         /* Next byte of the file to be sent */
+    off_t   end;                                                            /* End of the requested range */
+    off_t   length;                                                         /* Content bytes of the response */
+    double  requestStart;                                                   /* metricsClock() when the request has arrived */
+    char    *stats;                                                         /* Answer to STATS, sent instead of obuf */
+    char    obuf[MAXHEADERLEN];                                             /* Header, last modification date or answer to VERS waiting to be sent */
+    size_t  olen;
+    size_t  osent;
+    char    trailer[MAXTRAILERLEN];                                         /* Last modification date, sent after the body */
+    int     trailerLen;
+    int     version;                                                        /* Protocol version negotiated with VERS */
+    struct  socketTuner tuner;                                              /* TCP_INFO samples of the file being sent */
+    struct  shaper shaper;                                                  /* -S: bandwidth limits of the connection */
+    double  throttledUntil;                                                 /* metricsClock() when the tokens of the throttled connection are there */
+    struct  connection *nextThrottled, *prevThrottled;
+    int     throttled;                                                      /* In the throttled list, out of the loop until throttledUntil */
+    struct  schedEntry sched;                                               /* Turn of the body among the ready transfers */
+    size_t  allowance;                                                      /* Bytes left in the turn being served, 0 out of a turn */
+    time_t  lastActivity;
+};
+
+/* GLOBAL VARIABLES */
+
+char    *prog_name;
+char    ackMsg[5] = "+OK\r\n";
+int     epfd;
+struct  connection **connections;                                          /* Indexed by socket number, in order to find idle connections */
+int     maxConnections;
+int     tuneProfile = TUNE_NONE;                                            /* -t: socket options and buffer sizing, inherited by the accepted sockets */
+int     logLevel = LOG_INFO;                                                /* -L: less important messages are discarded */
+int     cacheFd = -1;                                                       /* inotify descriptor of the file cache */
+unsigned long lastRequests;                                                 /* Requests of small files at the last report of the file cache */
+int     activeConnections;
+struct  connection *throttledList;                                          /* Connections waiting for tokens, resumed by the main loop */
+
+
+void setPromptColor(const char *colorName)
+{
+    if(strcmp(colorName, "default") == 0)
+        printf("\033[0m");
+    else if(strcmp(colorName, "red") == 0)
+        printf("\033[1;31m");
+    else if(strcmp(colorName, "green") == 0)
+        printf("\033[1;32m");
+    else if(strcmp(colorName, "yellow") == 0)
+        printf("\033[1;33m");
+    else if(strcmp(colorName, "blue") == 0)
+        printf("\033[1;34m");
+    else if(strcmp(colorName, "magenta") == 0)
+        printf("\033[1;35m");
+    else if(strcmp(colorName, "cyan") == 0)
+        printf("\033[1;36m");
+}
+
+/* Parks a connection without tokens: it is served again after delay seconds, the main loop never waits longer than
+   the nearest deadline. Events of the socket meanwhile only find the tokens still missing */
+void throttle(struct connection *c, double delay)
+{
+    c->throttledUntil = metricsClock() + delay;
+
+    if(c->throttled)
+        return;
+
+    c->throttled     = 1;
+    c->prevThrottled = NULL;
+    c->nextThrottled = throttledList;
+    if(throttledList != NULL)
+        throttledList->prevThrottled = c;
+    throttledList = c;
+}
+
+void unthrottle(struct connection *c)
+{
+    if(!c->throttled)
+        return;
+
+    if(c->prevThrottled != NULL)
+        c->prevThrottled->nextThrottled = c->nextThrottled;
+    else
+        throttledList = c->nextThrottled;
+    if(c->nextThrottled != NULL)
+        c->nextThrottled->prevThrottled = c->prevThrottled;
+    c->throttled = 0;
+}
+
+/* Milliseconds until the nearest throttled connection can be resumed, at most maxWait */
+int throttleTimeout(int maxWait)
+{
+    double  now = metricsClock(), wait = maxWait / 1000.0;
+
+    for(struct connection *c = throttledList; c != NULL; c = c->nextThrottled)
+        if(c->throttledUntil - now < wait)
+            wait = c->throttledUntil - now;
+
+    return wait > 0 ? (int)(wait * 1000) + 1 : 0;
+}
+
+void closeConnection(struct connection *c)
+{
+    unthrottle(c);
+    schedRemove(&c->sched);
+
+    if(c->file != NULL)
+        fileCacheRelease(c->file);
+
+    close(c->socket);                                                       /* Closing the socket also removes it from the epoll set */
+    connections[c->socket] = NULL;
+    activeConnections--;
+    metricsAdd(METRIC_ACTIVE, -1);
+    free(c->stats);
+    free(c);
+}
+
+void sendErrorMessage(struct connection *c)
+{
+    char msgError[6] = "-ERR\r\n";
+
+    metricsAdd(METRIC_ERRORS, 1);
+
+    if(send(c->socket, msgError, sizeof(msgError), MSG_NOSIGNAL) != sizeof(msgError))   /* Socket is non-blocking, the message is sent only if it fits in the socket buffer */
+    {
+        err_log(LOG_WARNING, "Error message failure on socket %03d!", c->socket);
+    }
+
+    closeConnection(c);
+}
+
+/* Takes the requested file from the cache (or opens it) and prepares the header. Returns 1 if the file can not be served */
+int startTransfer(struct connection *c, char *line)
+{
+    struct  request req;
+
+    if(parseRequest(line, &req) == CMD_INVALID)                             /* "GET <fileName>", "GETR <fileName> <offset> <length>" or "RESUME ..." */
+        return 1;
+
+    if(req.command == CMD_VERS)                                             /* Protocol negotiation, no file involved */
+    {
+        c->version = req.version;
+        c->olen    = buildVersionReply(c->obuf, c->version);
+        c->osent   = 0;
+        c->state   = SENDING_VERSION;
+        return 0;
+    }
+
+    if(req.command == CMD_STATS)                                            /* Metrics, no file involved */
+    {
+        if((c->stats = buildStatsReply(&c->olen)) == NULL)
+            return 1;
+        c->osent   = 0;
+        c->state   = SENDING_STATS;
+        return 0;
+    }
+
+    if((c->file = fileCacheOpen(req.fileName)) == NULL)
+    {
+        err_log(LOG_WARNING, "An error occured while opening %s", req.fileName);
+        return 1;
+    }
+
+    if(checkRange(&req, c->version, c->file->size, &c->file->mtime) != 0)
+        return 1;
+
+    strncpy(c->fileName, req.fileName, BUFLEN - 1);
+    c->offset     = req.offset;
+    c->end        = req.offset + req.length;
+    c->length     = req.length;
+    c->trailerLen = buildTrailer(c->trailer, c->version, &c->file->mtime);
+
+    c->osent = 0;
+    c->state = SENDING_HEADER;
+
+    if((c->content = fileCacheContent(c->file)) != NULL)                   /* Small file in memory */
+    {
+        c->state = SENDING_CACHED;
+
+        if(req.command == CMD_GET)                                          /* Pre-serialized header */
+        {
+            c->olen = c->file->headerLen[c->version - 1];
+            memcpy(c->obuf, c->file->header[c->version - 1], c->olen);
+            return 0;
+        }
+    }
+
+    c->olen  = buildHeader(c->obuf, c->version, &req, c->file->size);
+
+    if(c->content == NULL)                                                  /* Header, sendfile() and trailer leave as full segments until the trailer is sent */
+    {
+        schedStart(&c->sched);                                              /* First turn before the transfers already going on */
+        tcpCork(c->socket, 1);
+        tunerInit(&c->tuner, c->socket, tuneProfile, 1);
+    }
+
+    return 0;
+}
+
+/* Sends the rest of buf (obuf or the answer to STATS). Returns 0 if everything is sent, -1 if the socket is full and 1 on error */
+int flushOutput(struct connection *c, char *buf)
+{
+    ssize_t n;
+
+    while(c->osent < c->olen)
+    {
+        n = send(c->socket, buf + c->osent, c->olen - c->osent, MSG_NOSIGNAL);
+
+        if(n < 0)
+        {
+            if(INTERRUPTED_BY_SIGNAL)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return -1;
+            return 1;
+        }
+
+        c->osent += n;
+    }
+
+    return 0;
+}
+
+/* Sends header, rest of the content and last modification with writev(), osent counts the bytes of all three.
+   Returns 0 if everything is sent, -1 if the socket is full and 1 on error */
+int flushCached(struct connection *c)
+{
+    struct  iovec iov[3];
+    struct  msghdr msg;
+    size_t  parts[3] = { c->olen, c->end - c->offset, c->trailerLen };
+    char    *bases[3] = { c->obuf, c->content + c->offset, c->trailer };
+    size_t  skip;
+    ssize_t n;
+    int     cnt;
+
+    for (;;)
+    {
+        skip = c->osent;
+        cnt  = 0;
+        for(int i = 0; i < 3; i++)
+        {
+            if(skip >= parts[i])
+            {
+                skip -= parts[i];
+                continue;
+            }
+            iov[cnt].iov_base = bases[i] + skip;
+            iov[cnt].iov_len  = parts[i] - skip;
+            skip = 0;
+            cnt++;
+        }
+
+        if(cnt == 0)
+            return 0;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov    = iov;
+        msg.msg_iovlen = cnt;
+
+        n = sendmsg(c->socket, &msg, MSG_NOSIGNAL);                         /* writev() with MSG_NOSIGNAL */
+
+        if(n < 0)
+        {
+            if(INTERRUPTED_BY_SIGNAL)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return -1;
+            return 1;
+        }
+
+        c->osent += n;
+    }
+}
+
+/* The body of the connection leaves the scheduler: its socket is full, it is throttled or it has been sent */
+void endTurn(struct connection *c)
+{
+    schedRemove(&c->sched);
+    c->allowance = 0;
+}
+
+/* Runs the state machine of the connection until the socket would block. The connection may be freed on return */
+void service(struct connection *c)
+{
+    char    *end;
+    size_t  reqLen;
+    ssize_t n;
+    off_t   count;
+    size_t  want;
+    int     res;
+
+    c->lastActivity = time(NULL);
+
+    for (;;)
+    {
+        switch(c->state)
+        {
+            case READING_REQUEST:
+                if((end = memchr(c->rbuf, '\n', c->rlen)) != NULL)         /* A whole request has already been received */
+                {
+                    reqLen = end - c->rbuf + 1;
+                    *end = '\0';
+
+                    metricsAdd(METRIC_REQUESTS, 1);
+                    c->requestStart = metricsClock();
+
+                    if(startTransfer(c, c->rbuf) != 0)
+                    {
+                        sendErrorMessage(c);
+                        return;
+                    }
+
+                    memmove(c->rbuf, c->rbuf + reqLen, c->rlen - reqLen);  /* Keep the bytes of the following request */
+                    c->rlen -= reqLen;
+                    break;
+                }
+
+                if(c->rlen == BUFLEN - 1)                                   /* Request line is too long */
+                {
+                    sendErrorMessage(c);
+                    return;
+                }
+
+                n = recv(c->socket, c->rbuf + c->rlen, BUFLEN - 1 - c->rlen, 0);
+
+                if(n < 0)
+                {
+                    if(INTERRUPTED_BY_SIGNAL)
+                        break;
+                    if(errno == EAGAIN || errno == EWOULDBLOCK)
+                        return;
+
+                    err_log(LOG_WARNING, "Read error! Connection %03d is being terminated", c->socket);
+                    sendErrorMessage(c);
+                    return;
+                }
+                else if(n == 0)                                             /* Client has closed the connection */
+                {
+                    closeConnection(c);
+                    return;
+                }
+
+                c->rlen += n;
+                c->rbuf[c->rlen] = '\0';
+                break;
+
+            case SENDING_HEADER:
+            case SENDING_MTIME:
+            case SENDING_VERSION:
+            case SENDING_STATS:
+                if((res = flushOutput(c, c->state == SENDING_STATS ? c->stats : c->obuf)) == -1)
+                    return;
+                else if(res == 1)
+                {
+                    if(errno == EPIPE || errno == ECONNRESET)                   /* The client has gone away */
+                        metricsAdd(METRIC_ABORTS, 1);
+                    closeConnection(c);
+                    return;
+                }
+
+                if(c->state == SENDING_HEADER)
+                    c->state = SENDING_BODY;
+                else if(c->state == SENDING_VERSION)
+                    c->state = READING_REQUEST;
+                else if(c->state == SENDING_STATS)
+                {
+                    free(c->stats);
+                    c->stats = NULL;
+                    c->state = READING_REQUEST;
+                }
+                else
+                {
+                    metricsAdd(METRIC_BYTES, c->length);
+                    metricsLatency(c->length, metricsClock() - c->requestStart);
+
+                    tcpCork(c->socket, 0);                                  /* Push the last segment now, not after the client's delayed ACK */
+                    if(c->content == NULL)
+                        tunerEnd(&c->tuner, c->socket);
+
+                    err_log(LOG_NOTICE, "%s has been successfully transferred on socket %03d!", c->fileName, c->socket);
+
+                    c->state = READING_REQUEST;
+                }
+                break;
+
+            case SENDING_CACHED:
+                if(c->osent == 0 && c->length > 0 && shaperGrant(&c->shaper, c->length) == 0)  /* Sent whole once the first quantum is there */
+                {
+                    throttle(c, shaperDelay(&c->shaper, c->length));
+                    return;
+                }
+
+                if((res = flushCached(c)) == -1)
+                    return;
+                else if(res == 1)
+                {
+                    if(errno == EPIPE || errno == ECONNRESET)
+                        metricsAdd(METRIC_ABORTS, 1);
+                    closeConnection(c);
+                    return;
+                }
+
+                metricsAdd(METRIC_BYTES, c->length);
+                metricsLatency(c->length, metricsClock() - c->requestStart);
+                shaperCharge(&c->shaper, c->length);                        /* The debt delays the next request */
+
+                fileCacheRelease(c->file);
+                c->file = NULL;
+
+                err_log(LOG_NOTICE, "%s has been successfully transferred on socket %03d!", c->fileName, c->socket);
+
+                c->state = READING_REQUEST;
+                break;
+
+            case SENDING_BODY:
+                while(c->offset < c->end)
+                {
+                    if(c->allowance == 0)                                   /* Not its turn: a big file does not hold the loop */
+                    {
+                        if(schedReady(&c->sched, c->end - c->offset) != 0)
+                            closeConnection(c);
+                        return;
+                    }
+
+                    count = c->end - c->offset;
+                    if((size_t)count > c->allowance)
+                        count = c->allowance;
+                    if((size_t)count > tunerLimit(&c->tuner))                     /* Stop at the next TCP_INFO sample */
+                        count = tunerLimit(&c->tuner);
+
+                    if((want = shaperGrant(&c->shaper, count)) == 0)        /* -S: wait for the tokens out of the loop, not in it */
+                    {
+                        endTurn(c);
+                        throttle(c, shaperDelay(&c->shaper, count));
+                        return;
+                    }
+
+                    n = sendfile(c->socket, c->file->fd, &c->offset, want);
+
+                    if(n < 0)
+                    {
+                        if(INTERRUPTED_BY_SIGNAL)
+                            continue;
+                        if(errno == EAGAIN || errno == EWOULDBLOCK)
+                        {
+                            endTurn(c);                                     /* Ready again with EPOLLOUT */
+                            return;
+                        }
+                    }
+
+                    if(n <= 0)                                              /* Socket error or the file has been truncated after fstat() */
+                    {
+                        if(n < 0 && (errno == EPIPE || errno == ECONNRESET))
+                            metricsAdd(METRIC_ABORTS, 1);
+                        err_log(LOG_WARNING, "Transfer failure! Connection %03d is being terminated", c->socket);
+                        closeConnection(c);
+                        return;
+                    }
+
+                    c->allowance -= n;
+                    schedCharge(&c->sched, n);
+                    shaperCharge(&c->shaper, n);
+                    tunerUpdate(&c->tuner, c->socket, n);                       /* Send buffer sized to the measured bandwidth-delay product */
+                }
+
+                endTurn(c);
+                fileCacheRelease(c->file);
+                c->file = NULL;
+
+                memcpy(c->obuf, c->trailer, c->trailerLen);
+                c->olen  = c->trailerLen;
+                c->osent = 0;
+                c->state = SENDING_MTIME;
+                break;
+        }
+    }
+}
+
+void acceptConnections(int listenSocket)
+{
+    struct  sockaddr_in caddr;
+    socklen_t addrlen;
+    struct  epoll_event ev;
+    struct  connection *c;
+    int     s;
+
+    for (;;)                                                                /* Edge triggered: accept until the queue is empty */
+    {
+        addrlen = sizeof(struct sockaddr_in);
+        s = accept4(listenSocket, (struct sockaddr *) &caddr, &addrlen, SOCK_NONBLOCK);
+
+        if(s < 0)
+        {
+            if(INTERRUPTED_BY_SIGNAL || errno == ECONNABORTED || errno == EPROTO)
+                continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                err_ret("(%s) error - accept() failed", prog_name);
+            return;
+        }
+
+        if(s >= maxConnections || (c = calloc(1, sizeof(struct connection))) == NULL)
+        {
+            close(s);
+            continue;
+        }
+
+        c->socket       = s;
+        c->state        = READING_REQUEST;
+        c->version      = PROTO_V1;
+        c->lastActivity = time(NULL);
+        c->sched.data   = c;
+        shaperStart(&c->shaper, caddr.sin_addr);                            /* Rate of the most specific -S rule for the client */
+
+        ev.events   = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = c;
+
+        if(epoll_ctl(epfd, EPOLL_CTL_ADD, s, &ev) < 0)
+        {
+            err_ret("(%s) error - epoll_ctl() failed", prog_name);
+            close(s);
+            free(c);
+            continue;
+        }
+
+        connections[s] = c;
+        activeConnections++;
+        metricsAdd(METRIC_CONNECTIONS, 1);
+        metricsAdd(METRIC_ACTIVE, 1);
+    }
+}
+
+/* Reports the file cache once a second while files are requested */
+void printCacheStats(void)
+{
+    struct  cacheStats st;
+
+    fileCacheStats(&st);
+
+    if(st.hits + st.misses == lastRequests)
+        return;
+    lastRequests = st.hits + st.misses;
+
+    err_log(LOG_INFO, "File cache: %d open files, %zu bytes of content, %lu hits, %lu misses, %lu evictions, %lu invalidations",
+            st.files, st.bytes, st.hits, st.misses, st.evictions, st.invalidations);
+}
+
+/* Gives one turn to each ready transfer (DRR), or as many turns to the shortest ones (SRPT), then the loop goes
+   back to epoll_wait(): new requests are read between two rounds */
+void runScheduler(void)
+{
+    struct  schedEntry *e;
+    size_t  allowance;
+
+    for(int turns = schedCount(); turns > 0 && (e = schedNext(&allowance)) != NULL; turns--)
+    {
+        ((struct connection *)e->data)->allowance = allowance;
+        service(e->data);                                                   /* Ends its turn or stays ready with the allowance spent */
+    }
+}
+
+/* Serves again the throttled connections whose deadline has passed */
+void resumeThrottled(void)
+{
+    double  now = metricsClock();
+    struct  connection *c, *next;
+
+    for(c = throttledList; c != NULL; c = next)
+    {
+        next = c->nextThrottled;
+        if(c->throttledUntil <= now)
+        {
+            unthrottle(c);
+            service(c);                                                     /* May throttle it again or close it */
+        }
+    }
+}
+
+void closeIdleConnections(void)
+{
+    time_t now = time(NULL);
+
+    for(int i = 0; i < maxConnections; i++)
+    {
+        if(connections[i] != NULL && now - connections[i]->lastActivity > TIMEOUT)
+        {
+            err_log(LOG_WARNING, "Timeout has expired on socket %03d!", i);
+            metricsAdd(METRIC_TIMEOUTS, 1);
+
+            sendErrorMessage(connections[i]);
+        }
+    }
+}
+
+int main (int argc, char *argv[])
+{
+    int		    listenSocket;	                                                /* passive socket */
+    uint16_t 	lport_n, lport_h;                                                   /* port used by server (net/host ord.) */
+    struct      sockaddr_in saddr;	                                                /* server address */
+    struct      epoll_event ev, events[MAXEVENTS];
+    struct      rlimit rl;
+    time_t      lastScan = time(NULL);
+    int         on = 1;
+    int         n;
+    int         opt;
+
+    prog_name = argv[0];
+
+    while ((opt = getopt(argc, argv, "t:L:S:F:")) != -1)
+    {
+        switch (opt)
+        {
+            case 't':                                                               /* Socket tuning profile, the chosen values are logged */
+                if((tuneProfile = tuneProfileByName(optarg)) == TUNE_NONE)
+                    goto usage;
+                break;
+            case 'L':                                                               /* Least important messages shown: err, warning, notice, info (default) or debug */
+                if((logLevel = err_level_by_name(optarg)) == -1)
+                    goto usage;
+                break;
+            case 'S':                                                               /* Bandwidth limit, repeatable: conn=RATE[:BURST], global=RATE[:BURST] or A.B.C.D/N=RATE[:BURST] */
+                if(shaperConfigure(optarg) != 0)
+                    goto usage;
+                break;
+            case 'F':                                                               /* Order of the body chunks: drr (round robin, default) or srpt (shortest remaining first), [:bytes per turn] */
+                if(schedConfigure(optarg) != 0)
+                    goto usage;
+                break;
+            default:
+            usage:                                                                  /* Unknown option or invalid value */
+                setPromptColor("red");
+                printf("Usage: ./server3_main [-t lan|wan|latency] [-L log level] [-S limit]... [-F drr|srpt[:quantum]] <port number>\n");
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    argc -= optind - 1;                                                             /* From now on argv[1] is the port number as before */
+    argv += optind - 1;
+
+    if (argc != 2)                                                                  /* To verify correctness of the arguments */
+    {
+        setPromptColor("red");
+        printf("Invalid amount of arguments!\n Usage: ./server3_main [-t lan|wan|latency] [-L log level] [-S limit]... [-F drr|srpt[:quantum]] <port number>\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (sscanf(argv[1], "%" SCNu16, &lport_h)!=1)                                   /* get server port number from command line */
+    {
+        setPromptColor("red");
+        err_sys("Invalid port number!\n");
+    }
+
+    lport_n = htons(lport_h);
+
+    err_async(logLevel);                                                            /* Messages are written by a background thread, a slow terminal does not stall the connections */
+
+    Signal(SIGPIPE, SIG_IGN);                                                       /* Broken connections are detected by the return values of send()/sendfile() */
+
+    metricsInit();
+
+    if(shaperInit() != 0)
+        err_sys("(%s) error - shaperInit() failed", prog_name);
+
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)             /* Every connection needs a socket and a file descriptor */
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    maxConnections = (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) ? (int)rl.rlim_cur : 65536;
+    connections = calloc(maxConnections, sizeof(struct connection *));
+
+    /* Socket Creation */
+    setPromptColor("cyan");
+    printf("\nCreating socket...\n");
+    listenSocket = Socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);       /* Non-blocking, accept() must never block the event loop */
+    Setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setPromptColor("green");
+    printf("Done, socket number %u\n", listenSocket);
+    setPromptColor("default");
+
+    /* Binding the socket to any local IP address */
+    bzero(&saddr, sizeof(saddr));
+    saddr.sin_family      = AF_INET;
+    saddr.sin_port        = lport_n;
+    saddr.sin_addr.s_addr = INADDR_ANY;                                             /* INADDR_ANY means all zeros */
+    setPromptColor("cyan");
+    showAddr("Binding to address", &saddr);
+    setPromptColor("default");
+    Bind(listenSocket, (struct sockaddr *) &saddr, sizeof(saddr));
+    setPromptColor("green");
+    printf("Binding has been completed.\n");
+    setPromptColor("default");
+
+    /* Listening the socket */
+    setPromptColor("cyan");
+    printf ("Listening at socket %d with backlog = %d\n", listenSocket, BACKLOG);
+    tuneSocket(listenSocket, tuneProfile);                                          /* Accepted sockets inherit the options */
+    Listen(listenSocket, BACKLOG);
+    setPromptColor("green");
+    printf("Done\n");
+    setPromptColor("default");
+
+    if((epfd = epoll_create1(0)) < 0)
+        err_sys("(%s) error - epoll_create1() failed", prog_name);
+
+    ev.events   = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;                                                             /* NULL marks the passive socket */
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, listenSocket, &ev) < 0)
+        err_sys("(%s) error - epoll_ctl() failed", prog_name);
+
+    if((cacheFd = fileCacheInit(FILE_CACHE_SIZE, CONTENT_CACHE_BUDGET)) != -1)                            /* Changed files are reported by inotify */
+    {
+        ev.events   = EPOLLIN | EPOLLET;
+        ev.data.ptr = &cacheFd;                                                     /* Marks the file cache notifications */
+        if(epoll_ctl(epfd, EPOLL_CTL_ADD, cacheFd, &ev) < 0)
+            err_sys("(%s) error - epoll_ctl() failed", prog_name);
+    }
+
+    for (;;)                                                                        /* Main server loop, server should never stop */
+    {
+        n = epoll_wait(epfd, events, MAXEVENTS, schedCount() > 0 ? 0 : throttleTimeout(1000));  /* Wake up at least once a second to check timeouts, earlier for throttled connections, do not wait while transfers are ready */
+
+        if(n < 0 && !INTERRUPTED_BY_SIGNAL)
+            err_sys("(%s) error - epoll_wait() failed", prog_name);
+
+        for(int i = 0; i < n; i++)                                                  /* Drop changed files before serving the requests of this round */
+            if(events[i].data.ptr == &cacheFd)
+                fileCacheInvalidate();
+
+        for(int i = 0; i < n; i++)
+        {
+            if(events[i].data.ptr == &cacheFd)
+                continue;
+            else if(events[i].data.ptr == NULL)
+                acceptConnections(listenSocket);
+            else
+                service(events[i].data.ptr);
+        }
+
+        resumeThrottled();
+        runScheduler();
+
+        if(time(NULL) != lastScan)
+        {
+            lastScan = time(NULL);
+            closeIdleConnections();
+            printCacheStats();
+        }
+    }
+}
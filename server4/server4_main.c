@@ -0,0 +1,872 @@
+/*****  TCP ASYNCHRONOUS SERVER (io_uring)   *****/
+
+#define _GNU_SOURCE                                                         /* pipe2() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "../errlib.h"
+#include "../sockwrap.h"
+#include "../protocol.h"
+#include "../filecache.h"
+#include "../socktune.h"
+#include "../metrics.h"
+#include "../shaper.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <errno.h>
+
+/* CONSTANTS */
+
+#define BUFLEN 128                                                          /* Receiver Buffer length */
+#define TIMEOUT 15                                                          /* A request must arrive in 15 seconds */
+#define BACKLOG 1024                                                        /* Maximum length of pending requests queue */
+#define RING_ENTRIES 4096                                                   /* Submission queue size */
+#define SPLICE_CHUNK 65536                                                  /* Bytes moved by one splice(), default pipe capacity */
+#define MAXCHUNKS 16                                                        /* file --> pipe --> socket pairs linked in one chain */
+#define FILE_CACHE_SIZE 1024                                                /* Open files kept with their size and last modification, a hit needs no openat() */
+#define CONTENT_CACHE_BUDGET (64*1024*1024)                                 /* Bytes of small files kept in memory, a hit is sent with one sendmsg() */
+#define USE_SQPOLL 0                                                        /* Set this constant 1 to let a kernel thread poll the submission queue (no io_uring_enter() while busy) */
+
+/* OPERATIONS, stored in the upper byte of user_data */
+
+#define OP_ACCEPT       1
+#define OP_RECV         2
+#define OP_TIMEOUT      3
+#define OP_OPEN         4
+#define OP_SEND_HEADER  6
+#define OP_SPLICE_IN    7                                                   /* file --> pipe */
+#define OP_SPLICE_OUT   8                                                   /* pipe --> socket */
+#define OP_SEND_MTIME   9
+#define OP_SEND_ERROR   10
+#define OP_SEND_VERSION 11                                                  /* Answer to VERS */
+#define OP_CACHE_POLL   12                                                  /* inotify descriptor of the file cache is readable */
+#define OP_SEND_CACHED  13                                                  /* Header, content from memory and last modification */
+#define OP_TICK         14                                                  /* Once a second */
+#define OP_SEND_STATS   15                                                  /* Answer to STATS */
+#define OP_THROTTLE     16                                                  /* Timeout of a connection waiting for the tokens of its next chain */
+
+/* DATA TYPES */
+
+struct ring
+{
+    int     fd;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned sqEntries;
+    unsigned *sqFlags;
+    struct  io_uring_sqe *sqes;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct  io_uring_cqe *cqes;
+    unsigned toSubmit;
+};
+
+struct connection
+{
+    int     socket;
+    struct  cachedFile *file;                                               /* File being sent, a reference to the file cache */
+    int     pipefd[2];
+    int     pending;                                                        /* Operations submitted and not completed yet */
+    int     failed;                                                         /* An operation of the current chain has failed */
+    int     closing;
+    char    rbuf[BUFLEN];
+    size_t  rlen;
+    char    fileName[BUFLEN];
+    struct  request req;                                                    /* Request being served, fileName points to the field above */
+    char    header[MAXHEADERLEN];                                           /* Also holds the answer to VERS */
+    size_t  headerLen;
+    char    trailer[MAXTRAILERLEN];                                         /* Last modification date */
+    size_t  trailerLen;
+    struct  iovec iov[3];                                                   /* Response of a file in memory */
+    struct  msghdr msg;
+    size_t  cachedLen;
+    int     version;                                                        /* Protocol version negotiated with VERS */
+    off_t   fileEnd;                                                        /* End of the requested range */
+    off_t   fileOffset;                                                     /* Bytes moved from file into the pipe */
+    off_t   bodySent;                                                       /* Bytes moved from the pipe into the socket */
+    int     headerSent;
+    int     mtimeSent;
+    char    *stats;                                                         /* Answer to STATS being sent */
+    size_t  statsLen;
+    double  requestStart;                                                   /* metricsClock() when the request has arrived */
+    char    *content;                                                       /* File in memory being sent, NULL if it is spliced */
+    struct  shaper shaper;                                                  /* -S: bandwidth limits of the connection */
+    struct  __kernel_timespec ts;                                           /* Request timeout or throttle delay, never both at the same time */
+};
+
+/* GLOBAL VARIABLES */
+
+char    *prog_name;
+char    ackMsg[5] = "+OK\r\n";
+char    msgError[6] = "-ERR\r\n";
+struct  ring ring;
+int     listenSocket;
+int     tuneProfile = TUNE_NONE;                                            /* -t: socket options and buffer sizing, inherited by the accepted sockets */
+int     logLevel = LOG_INFO;                                                /* -L: less important messages are discarded */
+int     cacheFd = -1;                                                       /* inotify descriptor of the file cache */
+struct  __kernel_timespec tickTs = { 1, 0 };
+unsigned long lastRequests;                                                 /* Requests of small files at the last report of the file cache */
+struct  sockaddr_in caddr;
+socklen_t caddrlen;
+
+
+void setPromptColor(const char *colorName)
+{
+    if(strcmp(colorName, "default") == 0)
+        printf("\033[0m");
+    else if(strcmp(colorName, "red") == 0)
+        printf("\033[1;31m");
+    else if(strcmp(colorName, "green") == 0)
+        printf("\033[1;32m");
+    else if(strcmp(colorName, "yellow") == 0)
+        printf("\033[1;33m");
+    else if(strcmp(colorName, "blue") == 0)
+        printf("\033[1;34m");
+    else if(strcmp(colorName, "magenta") == 0)
+        printf("\033[1;35m");
+    else if(strcmp(colorName, "cyan") == 0)
+        printf("\033[1;36m");
+}
+
+/* RING */
+
+void ringSetup(struct ring *r, unsigned entries)
+{
+    struct  io_uring_params p;
+    void    *sq, *cq;
+    size_t  sqLen, cqLen;
+
+    memset(&p, 0, sizeof(p));
+    if(USE_SQPOLL == 1)
+    {
+        p.flags = IORING_SETUP_SQPOLL;
+        p.sq_thread_idle = 1000;
+    }
+
+    if((r->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+        err_sys("(%s) error - io_uring_setup() failed", prog_name);
+
+    sqLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqLen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    if(p.features & IORING_FEAT_SINGLE_MMAP)                                /* Both rings share one mapping */
+    {
+        if(cqLen > sqLen)
+            sqLen = cqLen;
+        cqLen = sqLen;
+    }
+
+    sq = mmap(NULL, sqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if(sq == MAP_FAILED)
+        err_sys("(%s) error - mmap() of submission queue failed", prog_name);
+
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+        cq = sq;
+    else if((cq = mmap(NULL, cqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+        err_sys("(%s) error - mmap() of completion queue failed", prog_name);
+
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if(r->sqes == MAP_FAILED)
+        err_sys("(%s) error - mmap() of submission entries failed", prog_name);
+
+    r->sqHead    = (unsigned *)((char *)sq + p.sq_off.head);
+    r->sqTail    = (unsigned *)((char *)sq + p.sq_off.tail);
+    r->sqMask    = (unsigned *)((char *)sq + p.sq_off.ring_mask);
+    r->sqArray   = (unsigned *)((char *)sq + p.sq_off.array);
+    r->sqFlags   = (unsigned *)((char *)sq + p.sq_off.flags);
+    r->sqEntries = p.sq_entries;
+    r->cqHead    = (unsigned *)((char *)cq + p.cq_off.head);
+    r->cqTail    = (unsigned *)((char *)cq + p.cq_off.tail);
+    r->cqMask    = (unsigned *)((char *)cq + p.cq_off.ring_mask);
+    r->cqes      = (struct io_uring_cqe *)((char *)cq + p.cq_off.cqes);
+    r->toSubmit  = 0;
+}
+
+/* Submits the queued entries and waits for at least waitNr completions */
+void ringEnter(struct ring *r, unsigned waitNr)
+{
+    unsigned flags = waitNr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    int n;
+
+    if(USE_SQPOLL == 1)
+    {
+        if(__atomic_load_n(r->sqFlags, __ATOMIC_ACQUIRE) & IORING_SQ_NEED_WAKEUP)
+            flags |= IORING_ENTER_SQ_WAKEUP;
+        else if(waitNr == 0)
+        {
+            r->toSubmit = 0;
+            return;
+        }
+    }
+
+    n = syscall(__NR_io_uring_enter, r->fd, r->toSubmit, waitNr, flags, NULL, 0);
+
+    if(n < 0 && !INTERRUPTED_BY_SIGNAL && errno != EBUSY)
+        err_sys("(%s) error - io_uring_enter() failed", prog_name);
+
+    if(n > 0)
+        r->toSubmit -= (unsigned)n < r->toSubmit ? (unsigned)n : r->toSubmit;
+    if(USE_SQPOLL == 1)
+        r->toSubmit = 0;
+}
+
+struct io_uring_sqe *getSqe(struct ring *r, struct connection *c, int op)
+{
+    unsigned tail = *r->sqTail;
+    unsigned index;
+    struct  io_uring_sqe *sqe;
+
+    while(tail - __atomic_load_n(r->sqHead, __ATOMIC_ACQUIRE) >= r->sqEntries)  /* Queue is full, let the kernel consume it */
+        ringEnter(r, 0);
+
+    index = tail & *r->sqMask;
+    sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = ((uint64_t)op << 56) | (uint64_t)(uintptr_t)c;
+    r->sqArray[index] = index;
+
+    __atomic_store_n(r->sqTail, tail + 1, __ATOMIC_RELEASE);
+    r->toSubmit++;
+
+    if(c != NULL)
+        c->pending++;
+
+    return sqe;
+}
+
+/* SUBMISSIONS */
+
+void submitAccept(void)
+{
+    struct io_uring_sqe *sqe = getSqe(&ring, NULL, OP_ACCEPT);
+
+    caddrlen        = sizeof(caddr);
+    sqe->opcode     = IORING_OP_ACCEPT;
+    sqe->fd         = listenSocket;
+    sqe->addr       = (uint64_t)(uintptr_t)&caddr;
+    sqe->addr2      = (uint64_t)(uintptr_t)&caddrlen;
+}
+
+void submitRecv(struct connection *c)
+{
+    struct io_uring_sqe *sqe = getSqe(&ring, c, OP_RECV);
+
+    sqe->opcode     = IORING_OP_RECV;
+    sqe->fd         = c->socket;
+    sqe->addr       = (uint64_t)(uintptr_t)(c->rbuf + c->rlen);
+    sqe->len        = BUFLEN - 1 - c->rlen;
+    sqe->flags      = IOSQE_IO_LINK;                                        /* recv() is cancelled if the timeout below expires first */
+
+    c->ts.tv_sec    = TIMEOUT;
+    c->ts.tv_nsec   = 0;
+    sqe = getSqe(&ring, c, OP_TIMEOUT);
+    sqe->opcode     = IORING_OP_LINK_TIMEOUT;
+    sqe->addr       = (uint64_t)(uintptr_t)&c->ts;
+    sqe->len        = 1;
+}
+
+/* openat() of a file missing from the cache */
+void submitOpen(struct connection *c)
+{
+    struct io_uring_sqe *sqe = getSqe(&ring, c, OP_OPEN);
+
+    sqe->opcode     = IORING_OP_OPENAT;
+    sqe->fd         = AT_FDCWD;
+    sqe->addr       = (uint64_t)(uintptr_t)c->fileName;
+    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+}
+
+/* Header, content and last modification of a small file in memory with one sendmsg().
+   MSG_WAITALL lets io_uring retry a short send itself, the completion reports the whole response or an error */
+void submitCached(struct connection *c, char *content)
+{
+    struct io_uring_sqe *sqe = getSqe(&ring, c, OP_SEND_CACHED);
+
+    c->iov[0].iov_base = c->header;
+    c->iov[0].iov_len  = c->headerLen;
+    c->iov[1].iov_base = content + c->req.offset;
+    c->iov[1].iov_len  = c->req.length;
+    c->iov[2].iov_base = c->trailer;
+    c->iov[2].iov_len  = c->trailerLen;
+    c->cachedLen       = c->headerLen + c->req.length + c->trailerLen;
+
+    memset(&c->msg, 0, sizeof(c->msg));
+    c->msg.msg_iov     = c->iov;
+    c->msg.msg_iovlen  = 3;
+
+    sqe->opcode     = IORING_OP_SENDMSG;
+    sqe->fd         = c->socket;
+    sqe->addr       = (uint64_t)(uintptr_t)&c->msg;
+    sqe->len        = 1;
+    sqe->msg_flags  = MSG_NOSIGNAL | MSG_WAITALL;
+}
+
+void submitTick(void)
+{
+    struct io_uring_sqe *sqe = getSqe(&ring, NULL, OP_TICK);
+
+    sqe->opcode     = IORING_OP_TIMEOUT;
+    sqe->addr       = (uint64_t)(uintptr_t)&tickTs;
+    sqe->len        = 1;
+}
+
+/* One shot poll of the inotify descriptor, submitted again after every notification */
+void submitCachePoll(void)
+{
+    struct io_uring_sqe *sqe = getSqe(&ring, NULL, OP_CACHE_POLL);
+
+    sqe->opcode        = IORING_OP_POLL_ADD;
+    sqe->fd            = cacheFd;
+    sqe->poll32_events = POLLIN;
+}
+
+void submitSend(struct connection *c, int op, void *buf, size_t len, int flags)
+{
+    struct io_uring_sqe *sqe = getSqe(&ring, c, op);
+
+    sqe->opcode     = IORING_OP_SEND;
+    sqe->fd         = c->socket;
+    sqe->addr       = (uint64_t)(uintptr_t)buf;
+    sqe->len        = len;
+    sqe->msg_flags  = MSG_WAITALL | MSG_NOSIGNAL;
+    sqe->flags      = flags;
+
+    if(op == OP_SEND_HEADER)                                                /* Content follows, coalesced with the header */
+        sqe->msg_flags |= MSG_MORE;
+}
+
+void submitSplice(struct connection *c, int op, int fdIn, uint64_t offIn, int fdOut, size_t len)
+{
+    struct io_uring_sqe *sqe = getSqe(&ring, c, op);
+
+    sqe->opcode         = IORING_OP_SPLICE;
+    sqe->splice_fd_in   = fdIn;
+    sqe->splice_off_in  = offIn;
+    sqe->fd             = fdOut;
+    sqe->off            = (uint64_t)-1;
+    sqe->len            = len;
+    sqe->splice_flags   = SPLICE_F_MOVE;
+    sqe->flags          = IOSQE_IO_LINK;
+
+    if(fdOut == c->socket)                                                  /* As MSG_MORE: the trailer follows, only its send() pushes the last segment */
+        sqe->splice_flags |= SPLICE_F_MORE;
+}
+
+/* The connection waits delay seconds for its tokens: a timeout in the ring, completed as any other operation */
+void submitThrottle(struct connection *c, double delay)
+{
+    struct io_uring_sqe *sqe = getSqe(&ring, c, OP_THROTTLE);
+
+    c->ts.tv_sec    = (long long)delay;
+    c->ts.tv_nsec   = (long long)((delay - (long long)delay) * 1e9);
+    sqe->opcode     = IORING_OP_TIMEOUT;
+    sqe->addr       = (uint64_t)(uintptr_t)&c->ts;
+    sqe->len        = 1;
+}
+
+/* Submits the response from memory once the tokens of its first quantum are there, the rest becomes a debt */
+void submitShapedCached(struct connection *c)
+{
+    if(c->req.length > 0 && shaperGrant(&c->shaper, c->req.length) == 0)
+        submitThrottle(c, shaperDelay(&c->shaper, c->req.length));
+    else
+        submitCached(c, c->content);
+}
+
+/* Submits one linked chain: header (if not sent yet), up to MAXCHUNKS file --> pipe --> socket pairs and
+   last modification date (if the whole content fits in this chain). A short transfer breaks the chain,
+   the rest is cancelled and the chain is submitted again from the current position. With -S the chain reads no
+   more than the tokens of the connection, if they are less than a quantum the chain waits for them in the ring. */
+void submitResponse(struct connection *c)
+{
+    off_t   inPipe = c->fileOffset - c->bodySent;
+    off_t   offset = c->fileOffset;
+    off_t   budget = c->fileEnd - offset;
+    size_t  len;
+    struct  io_uring_sqe *last = NULL;
+
+    if(budget > 0 && (budget = shaperGrant(&c->shaper, budget)) == 0 && inPipe == 0)
+    {
+        submitThrottle(c, shaperDelay(&c->shaper, c->fileEnd - offset));
+        return;
+    }
+
+    c->failed = 0;
+
+    if(c->headerSent == 0)
+        submitSend(c, OP_SEND_HEADER, c->header, c->headerLen, IOSQE_IO_LINK);
+
+    for(int i = 0; i < MAXCHUNKS && (inPipe > 0 || budget > 0); i++)
+    {
+        if(inPipe == 0)
+        {
+            len = budget < SPLICE_CHUNK ? (size_t)budget : SPLICE_CHUNK;
+            submitSplice(c, OP_SPLICE_IN, c->file->fd, offset, c->pipefd[1], len);
+            offset += len;
+            budget -= len;
+            inPipe  = len;
+        }
+
+        submitSplice(c, OP_SPLICE_OUT, c->pipefd[0], (uint64_t)-1, c->socket, inPipe);
+        inPipe = 0;
+        last = &ring.sqes[(*ring.sqTail - 1) & *ring.sqMask];
+    }
+
+    if(offset == c->fileEnd && inPipe == 0)
+        submitSend(c, OP_SEND_MTIME, c->trailer, c->trailerLen, 0);
+    else if(last != NULL)
+        last->flags &= ~IOSQE_IO_LINK;                                      /* End of this chain */
+}
+
+void submitError(struct connection *c)
+{
+    err_log(LOG_WARNING, "Transfer failure! Connection %03d is being terminated", c->socket);
+
+    c->closing = 1;
+    metricsAdd(METRIC_ERRORS, 1);
+    submitSend(c, OP_SEND_ERROR, msgError, sizeof(msgError), 0);
+}
+
+/* COMPLETIONS */
+
+/* Reports the file cache once a second while files are requested */
+void printCacheStats(void)
+{
+    struct  cacheStats st;
+
+    fileCacheStats(&st);
+
+    if(st.hits + st.misses == lastRequests)
+        return;
+    lastRequests = st.hits + st.misses;
+
+    err_log(LOG_INFO, "File cache: %d open files, %zu bytes of content, %lu hits, %lu misses, %lu evictions, %lu invalidations",
+            st.files, st.bytes, st.hits, st.misses, st.evictions, st.invalidations);
+}
+
+void closeConnection(struct connection *c)
+{
+    if(c->file != NULL)
+        fileCacheRelease(c->file);
+    close(c->pipefd[0]);
+    close(c->pipefd[1]);
+    close(c->socket);
+    metricsAdd(METRIC_ACTIVE, -1);
+    free(c->stats);
+    free(c);
+}
+
+/* Prepares header and last modification of the requested range of c->file and submits the response */
+void startResponse(struct connection *c)
+{
+    char    *content;
+
+    if(checkRange(&c->req, c->version, c->file->size, &c->file->mtime) != 0)
+    {
+        err_log(LOG_WARNING, "An error occured while opening %s", c->fileName);
+        submitError(c);
+        return;
+    }
+
+    c->fileEnd    = c->req.offset + c->req.length;
+    c->fileOffset = c->req.offset;
+    c->bodySent   = c->req.offset;
+    c->headerSent = 0;
+    c->mtimeSent  = 0;
+    c->headerLen  = buildHeader(c->header, c->version, &c->req, c->file->size);
+    c->trailerLen = buildTrailer(c->trailer, c->version, &c->file->mtime);
+
+    if((content = fileCacheContent(c->file)) != NULL)                       /* Small file in memory */
+    {
+        if(c->req.command == CMD_GET)                                       /* Pre-serialized header */
+        {
+            c->headerLen = c->file->headerLen[c->version - 1];
+            memcpy(c->header, c->file->header[c->version - 1], c->headerLen);
+        }
+        c->content = content;
+        submitShapedCached(c);
+        return;
+    }
+
+    c->content = NULL;
+    submitResponse(c);
+}
+
+/* Looks for a whole request line in rbuf and starts serving it, otherwise receives more bytes */
+void nextRequest(struct connection *c)
+{
+    char    *end;
+    size_t  reqLen;
+
+    if((end = memchr(c->rbuf, '\n', c->rlen)) == NULL)
+    {
+        if(c->rlen == BUFLEN - 1)                                           /* Request line is too long */
+            submitError(c);
+        else
+            submitRecv(c);
+        return;
+    }
+
+    reqLen = end - c->rbuf + 1;
+    *end = '\0';
+
+    metricsAdd(METRIC_REQUESTS, 1);
+    c->requestStart = metricsClock();
+
+    if(parseRequest(c->rbuf, &c->req) == CMD_INVALID)                       /* "GET <fileName>", "GETR <fileName> <offset> <length>" or "RESUME ..." */
+    {
+        submitError(c);
+        return;
+    }
+
+    if(c->req.command == CMD_VERS)                                          /* Protocol negotiation, no file involved */
+    {
+        memmove(c->rbuf, c->rbuf + reqLen, c->rlen - reqLen);
+        c->rlen -= reqLen;
+
+        c->version = c->req.version;
+        submitSend(c, OP_SEND_VERSION, c->header, buildVersionReply(c->header, c->version), 0);
+        return;
+    }
+
+    if(c->req.command == CMD_STATS)                                         /* Metrics, no file involved */
+    {
+        memmove(c->rbuf, c->rbuf + reqLen, c->rlen - reqLen);
+        c->rlen -= reqLen;
+
+        if((c->stats = buildStatsReply(&c->statsLen)) == NULL)
+            submitError(c);
+        else
+            submitSend(c, OP_SEND_STATS, c->stats, c->statsLen, 0);
+        return;
+    }
+
+    strncpy(c->fileName, c->req.fileName, BUFLEN - 1);
+    c->req.fileName = c->fileName;
+    memmove(c->rbuf, c->rbuf + reqLen, c->rlen - reqLen);                   /* Keep the bytes of the following request */
+    c->rlen -= reqLen;
+
+    if((c->file = fileCacheLookup(c->fileName)) != NULL)                    /* Hit: the response starts at once */
+        startResponse(c);
+    else
+        submitOpen(c);
+}
+
+void acceptCompleted(int res)
+{
+    struct connection *c;
+
+    submitAccept();                                                         /* Keep one accept() always in flight */
+
+    if(res < 0)
+        return;
+
+    if((c = calloc(1, sizeof(struct connection))) == NULL || pipe2(c->pipefd, O_CLOEXEC) == -1)
+    {
+        free(c);
+        close(res);
+        return;
+    }
+
+    c->socket   = res;
+    c->version  = PROTO_V1;
+    shaperStart(&c->shaper, caddr.sin_addr);                                /* Rate of the most specific -S rule for the client */
+
+    metricsAdd(METRIC_CONNECTIONS, 1);
+    metricsAdd(METRIC_ACTIVE, 1);
+
+    submitRecv(c);
+}
+
+void completion(struct connection *c, int op, int res)
+{
+    c->pending--;
+
+    if(res == -EPIPE || res == -ECONNRESET)                                 /* The client has gone away during a response */
+        metricsAdd(METRIC_ABORTS, 1);
+
+    switch(op)
+    {
+        case OP_RECV:
+            if(res <= 0)                                                    /* Client has closed the connection, an error or the timeout */
+            {
+                if(res == -ECANCELED)
+                {
+                    err_log(LOG_WARNING, "Timeout has expired on socket %03d!", c->socket);
+                    metricsAdd(METRIC_TIMEOUTS, 1);
+                    submitError(c);
+                }
+                else
+                    c->closing = 1;
+                break;
+            }
+            c->rlen += res;
+            c->rbuf[c->rlen] = '\0';
+            break;
+
+        case OP_OPEN:
+            if(res >= 0 && (c->file = fileCacheInsert(c->fileName, res)) == NULL)
+                close(res);
+            break;
+
+        case OP_SEND_HEADER:
+            if(res == (int)c->headerLen)
+                c->headerSent = 1;
+            else
+                c->failed = 1;
+            break;
+
+        case OP_SPLICE_IN:
+            if(res > 0)
+                c->fileOffset += res;
+            if(res != -ECANCELED && res <= 0)
+                c->closing = 1;                                             /* Header has already been sent, nothing else can be done */
+            break;
+
+        case OP_SPLICE_OUT:
+            if(res > 0)
+            {
+                c->bodySent += res;
+                shaperCharge(&c->shaper, res);
+            }
+            if(res != -ECANCELED && res <= 0)
+                c->closing = 1;
+            break;
+
+        case OP_SEND_MTIME:
+            if(res == (int)c->trailerLen)
+                c->mtimeSent = 1;
+            else if(res != -ECANCELED)
+                c->closing = 1;
+            break;
+
+        case OP_SEND_ERROR:
+            c->closing = 1;
+            break;
+
+        case OP_SEND_VERSION:
+            if(res != VERSREPLYLEN)
+                c->closing = 1;
+            break;
+
+        case OP_SEND_CACHED:
+            if(res != (int)c->cachedLen)
+                c->closing = 1;
+            break;
+
+        case OP_SEND_STATS:
+            if(res != (int)c->statsLen)
+                c->closing = 1;
+            free(c->stats);
+            c->stats = NULL;
+            break;
+    }
+
+    if(c->pending > 0)                                                      /* Wait for the rest of the chain */
+        return;
+
+    if(c->closing == 1)
+    {
+        closeConnection(c);
+        return;
+    }
+
+    switch(op)
+    {
+        case OP_RECV:
+        case OP_TIMEOUT:
+        case OP_SEND_VERSION:
+        case OP_SEND_STATS:
+            nextRequest(c);
+            break;
+
+        case OP_OPEN:
+            if(c->file == NULL)
+            {
+                err_log(LOG_WARNING, "An error occured while opening %s", c->fileName);
+                submitError(c);
+                break;
+            }
+
+            startResponse(c);
+            break;
+
+        case OP_SEND_CACHED:
+            fileCacheRelease(c->file);
+            c->file = NULL;
+
+            metricsAdd(METRIC_BYTES, c->req.length);
+            metricsLatency(c->req.length, metricsClock() - c->requestStart);
+            shaperCharge(&c->shaper, c->req.length);                        /* The debt delays the next request */
+
+            err_log(LOG_NOTICE, "%s has been successfully transferred on socket %03d!", c->fileName, c->socket);
+
+            nextRequest(c);
+            break;
+
+        case OP_THROTTLE:                                                   /* Tokens are there, or the timeout has been cut short */
+            if(c->content != NULL)
+                submitShapedCached(c);
+            else
+                submitResponse(c);
+            break;
+
+        default:                                                            /* End of a response chain */
+            if(c->headerSent == 0 && c->failed == 1)
+            {
+                closeConnection(c);
+                break;
+            }
+
+            if(c->mtimeSent == 0)
+            {
+                submitResponse(c);                                          /* Continue from where the chain has stopped */
+                break;
+            }
+
+            fileCacheRelease(c->file);
+            c->file = NULL;
+
+            metricsAdd(METRIC_BYTES, c->req.length);
+            metricsLatency(c->req.length, metricsClock() - c->requestStart);
+
+            err_log(LOG_NOTICE, "%s has been successfully transferred on socket %03d!", c->fileName, c->socket);
+
+            nextRequest(c);
+            break;
+    }
+}
+
+int main (int argc, char *argv[])
+{
+    uint16_t 	lport_n, lport_h;                                                   /* port used by server (net/host ord.) */
+    struct      sockaddr_in saddr;	                                                /* server address */
+    struct      io_uring_cqe *cqe;
+    unsigned    head;
+    int         on = 1;
+    int         opt;
+
+    prog_name = argv[0];
+
+    while ((opt = getopt(argc, argv, "t:L:S:")) != -1)
+    {
+        switch (opt)
+        {
+            case 't':                                                               /* Socket tuning profile, the chosen values are logged */
+                if((tuneProfile = tuneProfileByName(optarg)) == TUNE_NONE)
+                    goto usage;
+                break;
+            case 'L':                                                               /* Least important messages shown: err, warning, notice, info (default) or debug */
+                if((logLevel = err_level_by_name(optarg)) == -1)
+                    goto usage;
+                break;
+            case 'S':                                                               /* Bandwidth limit, repeatable: conn=RATE[:BURST], global=RATE[:BURST] or A.B.C.D/N=RATE[:BURST] */
+                if(shaperConfigure(optarg) != 0)
+                    goto usage;
+                break;
+            default:
+            usage:                                                                  /* Unknown option or invalid value */
+                setPromptColor("red");
+                printf("Usage: ./server4_main [-t lan|wan|latency] [-L log level] [-S limit]... <port number>\n");
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    argc -= optind - 1;                                                             /* From now on argv[1] is the port number as before */
+    argv += optind - 1;
+
+    if (argc != 2)                                                                  /* To verify correctness of the arguments */
+    {
+        setPromptColor("red");
+        printf("Invalid amount of arguments!\n Usage: ./server4_main [-t lan|wan|latency] [-L log level] [-S limit]... <port number>\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (sscanf(argv[1], "%" SCNu16, &lport_h)!=1)                                   /* get server port number from command line */
+    {
+        setPromptColor("red");
+        err_sys("Invalid port number!\n");
+    }
+
+    lport_n = htons(lport_h);
+
+    err_async(logLevel);                                                            /* Messages are written by a background thread, a slow terminal does not stall the ring */
+
+    Signal(SIGPIPE, SIG_IGN);
+
+    metricsInit();
+
+    if(shaperInit() != 0)
+        err_sys("(%s) error - shaperInit() failed", prog_name);
+
+    /* Socket Creation */
+    setPromptColor("cyan");
+    printf("\nCreating socket...\n");
+    listenSocket = Socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    Setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setPromptColor("green");
+    printf("Done, socket number %u\n", listenSocket);
+    setPromptColor("default");
+
+    /* Binding the socket to any local IP address */
+    bzero(&saddr, sizeof(saddr));
+    saddr.sin_family      = AF_INET;
+    saddr.sin_port        = lport_n;
+    saddr.sin_addr.s_addr = INADDR_ANY;                                             /* INADDR_ANY means all zeros */
+    setPromptColor("cyan");
+    showAddr("Binding to address", &saddr);
+    setPromptColor("default");
+    Bind(listenSocket, (struct sockaddr *) &saddr, sizeof(saddr));
+    setPromptColor("green");
+    printf("Binding has been completed.\n");
+    setPromptColor("default");
+
+    /* Listening the socket */
+    setPromptColor("cyan");
+    printf ("Listening at socket %d with backlog = %d\n", listenSocket, BACKLOG);
+    tuneSocket(listenSocket, tuneProfile);                                          /* Accepted sockets inherit the options */
+    Listen(listenSocket, BACKLOG);
+    setPromptColor("green");
+    printf("Done\n");
+    setPromptColor("default");
+
+    ringSetup(&ring, RING_ENTRIES);
+    submitAccept();
+
+    if((cacheFd = fileCacheInit(FILE_CACHE_SIZE, CONTENT_CACHE_BUDGET)) != -1)                            /* Changed files are reported by inotify */
+        submitCachePoll();
+    submitTick();
+
+    for (;;)                                                                        /* Main server loop: one io_uring_enter() submits everything queued and waits */
+    {
+        ringEnter(&ring, 1);
+
+        head = *ring.cqHead;
+        while(head != __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE))
+        {
+            cqe = &ring.cqes[head & *ring.cqMask];
+
+            if((cqe->user_data >> 56) == OP_ACCEPT)
+                acceptCompleted(cqe->res);
+            else if((cqe->user_data >> 56) == OP_CACHE_POLL)
+            {
+                fileCacheInvalidate();
+                submitCachePoll();
+            }
+            else if((cqe->user_data >> 56) == OP_TICK)
+            {
+                printCacheStats();
+                submitTick();
+            }
+            else
+                completion((struct connection *)(uintptr_t)(cqe->user_data & ((1ULL << 56) - 1)), (int)(cqe->user_data >> 56), cqe->res);
+
+            head++;
+            __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+        }
+    }
+}
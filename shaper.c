@@ -0,0 +1,257 @@
+/*
+
+module: shaper.c
+
+purpose: token buckets limiting the bandwidth of each connection, of the clients of a subnet and of the
+	 whole server.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+
+#include "shaper.h"
+
+struct rule {
+	uint32_t net, mask;		/* Host order */
+	int	prefix;
+	double	rate, burst;
+};
+
+struct globalBucket {			/* Shared mapping */
+	atomic_flag lock;
+	struct tokenBucket bucket;
+};
+
+static double connRate, connBurst;	/* 0: connections are not limited */
+static double globalRate, globalBurst;
+static struct rule rules[SHAPER_RULES];
+static int ruleCount;
+static struct globalBucket *global;	/* NULL: no global limit */
+
+
+static double now (void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* "RATE[:BURST]", k, m and g suffixes. Returns -1 if invalid */
+
+static int parseRate (const char *arg, double *rate, double *burst) {
+	double *value = rate;
+	char *end;
+
+	*burst = 0;
+	for (;;) {
+		*value = strtod(arg, &end);
+		if (end == arg || *value <= 0)
+			return -1;
+		if (*end == 'k' || *end == 'K')
+			*value *= 1024, end++;
+		else if (*end == 'm' || *end == 'M')
+			*value *= 1024 * 1024, end++;
+		else if (*end == 'g' || *end == 'G')
+			*value *= 1024 * 1024 * 1024, end++;
+
+		if (*end == '\0')
+			break;
+		if (*end != ':' || value == burst)
+			return -1;
+		value = burst;
+		arg = end + 1;
+	}
+
+	if (*burst == 0)
+		*burst = *rate / 10 > SHAPER_MINBURST ? *rate / 10 : SHAPER_MINBURST;
+	return 0;
+}
+
+
+/* One -S option: "conn=RATE[:BURST]", "global=RATE[:BURST]" or "A.B.C.D/N=RATE[:BURST]". Returns 0 on success */
+
+int shaperConfigure (const char *spec) {
+	char addr[32];
+	const char *eq = strchr(spec, '=');
+	struct in_addr a;
+	struct rule *r;
+	int prefix;
+
+	if (eq == NULL || eq - spec >= (int)sizeof(addr))
+		return -1;
+	memcpy(addr, spec, eq - spec);
+	addr[eq - spec] = '\0';
+
+	if (strcmp(addr, "conn") == 0)
+		return parseRate(eq + 1, &connRate, &connBurst);
+	if (strcmp(addr, "global") == 0)
+		return parseRate(eq + 1, &globalRate, &globalBurst);
+
+	if (ruleCount == SHAPER_RULES || strchr(addr, '/') == NULL)
+		return -1;
+	prefix = atoi(strchr(addr, '/') + 1);
+	*strchr(addr, '/') = '\0';
+	if (prefix < 0 || prefix > 32 || inet_aton(addr, &a) == 0)
+		return -1;
+
+	r = &rules[ruleCount];
+	r->prefix = prefix;
+	r->mask = prefix == 0 ? 0 : 0xffffffffU << (32 - prefix);
+	r->net = ntohl(a.s_addr) & r->mask;
+	if (parseRate(eq + 1, &r->rate, &r->burst) != 0)
+		return -1;
+	ruleCount++;
+	return 0;
+}
+
+
+/* Maps the global bucket. Must be called after the options and before forking. Returns -1 on failure */
+
+int shaperInit (void) {
+	void *p;
+
+	if (globalRate == 0)
+		return 0;
+
+	p = mmap(NULL, sizeof(struct globalBucket), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return -1;
+
+	global = p;
+	atomic_flag_clear(&global->lock);
+	global->bucket.rate = globalRate;
+	global->bucket.burst = globalBurst;
+	global->bucket.tokens = globalBurst;
+	global->bucket.last = now();
+	return 0;
+}
+
+
+/* Chooses the rate of a new connection from client */
+
+void shaperStart (struct shaper *s, struct in_addr client) {
+	uint32_t ip = ntohl(client.s_addr);
+	double rate = connRate, burst = connBurst;
+	int best = -1;
+
+	for (int i = 0; i < ruleCount; i++)
+		if ((ip & rules[i].mask) == rules[i].net && rules[i].prefix > best) {
+			best = rules[i].prefix;
+			rate = rules[i].rate;
+			burst = rules[i].burst;
+		}
+
+	memset(s, 0, sizeof(*s));
+	s->limited = rate > 0;
+	s->global = global != NULL;
+	s->bucket.rate = rate;
+	s->bucket.burst = burst;
+	s->bucket.tokens = burst;
+	s->bucket.last = now();
+}
+
+
+static void refill (struct tokenBucket *b, double t) {
+	if (t > b->last) {
+		b->tokens += (t - b->last) * b->rate;
+		if (b->tokens > b->burst)
+			b->tokens = b->burst;
+		b->last = t;
+	}
+}
+
+
+static void lockGlobal (void) {
+	while (atomic_flag_test_and_set_explicit(&global->lock, memory_order_acquire))
+		;			/* A few instructions of another process */
+}
+
+static void unlockGlobal (void) {
+	atomic_flag_clear_explicit(&global->lock, memory_order_release);
+}
+
+
+/* Tokens now available to s: the smaller of its own and the global ones */
+
+static double available (struct shaper *s) {
+	double t = now(), tokens = -1;
+
+	if (s->limited) {
+		refill(&s->bucket, t);
+		tokens = s->bucket.tokens;
+	}
+	if (s->global) {
+		lockGlobal();
+		refill(&global->bucket, t);
+		if (tokens < 0 || global->bucket.tokens < tokens)
+			tokens = global->bucket.tokens;
+		unlockGlobal();
+	}
+	return tokens;
+}
+
+
+static size_t quantum (struct shaper *s, size_t want) {
+	double q = SHAPER_QUANTUM;
+
+	if (s->limited && s->bucket.burst < q)
+		q = s->bucket.burst;
+	if (s->global && global->bucket.burst < q)
+		q = global->bucket.burst;
+	return want < q ? want : (size_t)q;
+}
+
+
+/* Bytes of want that can be sent now, 0 if less than a quantum is available */
+
+size_t shaperGrant (struct shaper *s, size_t want) {
+	double tokens;
+
+	if (!s->limited && !s->global)
+		return want;
+
+	tokens = available(s);
+	if (tokens < quantum(s, want))
+		return 0;
+	return tokens < want ? (size_t)tokens : want;
+}
+
+
+/* Seconds until shaperGrant(s, want) returns more than 0 */
+
+double shaperDelay (struct shaper *s, size_t want) {
+	double need = quantum(s, want), delay = 0, d;
+
+	if (s->limited) {
+		refill(&s->bucket, now());
+		if ((d = (need - s->bucket.tokens) / s->bucket.rate) > delay)
+			delay = d;
+	}
+	if (s->global) {
+		lockGlobal();
+		d = (need - global->bucket.tokens) / global->bucket.rate;	/* Refilled by available() */
+		unlockGlobal();
+		if (d > delay)
+			delay = d;
+	}
+	return delay;
+}
+
+
+void shaperCharge (struct shaper *s, size_t n) {
+	if (s->limited)
+		s->bucket.tokens -= n;
+	if (s->global) {
+		lockGlobal();
+		global->bucket.tokens -= n;
+		unlockGlobal();
+	}
+}
@@ -0,0 +1,52 @@
+/*
+
+module: shaper.h
+
+purpose: definitions of functions in shaper.c
+
+*/
+
+#ifndef _SHAPER_H
+
+#define _SHAPER_H
+
+#include <stddef.h>
+#include <netinet/in.h>
+
+#define SHAPER_RULES	32		/* Per-subnet rates */
+#define SHAPER_QUANTUM	16384		/* A throttled connection waits for at least this many bytes (or its burst) */
+#define SHAPER_MINBURST	65536		/* Default burst: 100 ms of the rate, at least this */
+
+struct tokenBucket {
+	double	rate;			/* Bytes per second */
+	double	burst;			/* Maximum tokens */
+	double	tokens;			/* Negative after a charge bigger than the tokens: debt paid before the next grant */
+	double	last;			/* Time of the last refill */
+};
+
+struct shaper {				/* One per connection */
+	int	limited;		/* Per-connection bucket in use */
+	int	global;			/* Global bucket in use */
+	struct tokenBucket bucket;
+};
+
+/* Body bytes are limited by a token bucket of the connection (-S conn=RATE, or the rate of the most specific
+ * -S A.B.C.D/N=RATE rule matching the client) and by a global bucket (-S global=RATE) shared by all the
+ * connections and, being created by shaperInit() before forking, by all the processes of a server.
+ * shaperGrant() tells how many bytes may be sent now without consuming them, 0 if the connection has to wait
+ * shaperDelay() seconds; the bytes actually sent are then consumed with shaperCharge(). Nothing sleeps here:
+ * each server waits for the delay in its own event loop. Rates take k, m, g suffixes (bytes per second). */
+
+int shaperConfigure (const char *spec);
+
+int shaperInit (void);
+
+void shaperStart (struct shaper *s, struct in_addr client);
+
+size_t shaperGrant (struct shaper *s, size_t want);
+
+double shaperDelay (struct shaper *s, size_t want);
+
+void shaperCharge (struct shaper *s, size_t n);
+
+#endif
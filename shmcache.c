@@ -0,0 +1,239 @@
+/*
+
+module: shmcache.c
+
+purpose: content of small files in a shared memory segment mapped by the parent before forking,
+	 so a file read by one process is served from memory by all the others.
+	 Lock-free readers (sequence numbers), one writer at a time, CLOCK replacement within each set.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "shmcache.h"
+
+struct shmSlot {
+	atomic_uint	seq;		/* Odd while the slot is being written */
+	atomic_int	referenced;	/* Set by readers, cleared by the CLOCK hand */
+	int	used;
+	unsigned hash;
+	off_t	size;
+	struct timespec mtime;
+	dev_t	dev;
+	ino_t	ino;
+	char	path[SHMPATHLEN];
+};
+
+struct shmSet {
+	unsigned hand;			/* Next slot checked for replacement, changed by the writer only */
+	struct shmSlot slot[SHMWAYS];
+};
+
+struct shmHeader {
+	atomic_int	writer;		/* pid of the writing process, 0 if none */
+	atomic_ulong	hits;
+	atomic_ulong	misses;
+	atomic_ulong	evictions;
+	atomic_ulong	invalidations;
+	unsigned setMask;
+	struct shmSet set[];		/* Followed by the content, MAXCONTENTSIZE bytes per slot */
+};
+
+static struct shmHeader *shm;
+static char *data;
+
+
+static unsigned hash_path (const char *path) {
+	unsigned h = 2166136261u;	/* FNV-1a, as the file cache */
+
+	while (*path)
+		h = (h ^ (unsigned char)*path++) * 16777619u;
+	return h;
+}
+
+
+static char *slot_data (struct shmSet *set, int way) {
+	return data + ((size_t)(set - shm->set) * SHMWAYS + way) * MAXCONTENTSIZE;
+}
+
+
+static int same_file (const struct shmSlot *s, const struct cachedFile *f, unsigned h) {
+	return s->used && s->hash == h && s->size == f->size && s->dev == f->dev && s->ino == f->ino &&
+	       s->mtime.tv_sec == f->mtime.tv_sec && s->mtime.tv_nsec == f->mtime.tv_nsec &&
+	       strncmp(s->path, f->path, SHMPATHLEN) == 0;
+}
+
+
+/* Copies the content of f from the slot. Returns 0 if the slot holds another file or has been written meanwhile */
+
+static int read_slot (struct shmSet *set, int way, const struct cachedFile *f, unsigned h, char *buf) {
+	struct shmSlot *s = &set->slot[way];
+	unsigned seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+
+	if ((seq & 1) || !same_file(s, f, h))
+		return 0;
+
+	memcpy(buf, slot_data(set, way), f->size);
+
+	atomic_thread_fence(memory_order_acquire);	/* The copy is complete before the sequence number is checked again */
+	if (atomic_load_explicit(&s->seq, memory_order_relaxed) != seq)
+		return 0;
+
+	if (atomic_load_explicit(&s->referenced, memory_order_relaxed) == 0)	/* Avoid writing the line at every hit */
+		atomic_store_explicit(&s->referenced, 1, memory_order_relaxed);
+	return 1;
+}
+
+
+/* Returns 1 if this process is now the writer. A writer that has died while storing is replaced */
+
+static int lock_writer (void) {
+	int holder = 0;
+
+	if (atomic_compare_exchange_strong(&shm->writer, &holder, getpid()))
+		return 1;
+	if (kill(holder, 0) == -1 && errno == ESRCH)
+		return atomic_compare_exchange_strong(&shm->writer, &holder, getpid());
+	return 0;
+}
+
+
+/* Way to be overwritten: an older version of the file, a free slot or the first one not referenced since the hand passed it */
+
+static int victim (struct shmSet *set, const struct cachedFile *f, unsigned h) {
+	struct shmSlot *s;
+
+	for (int way = 0; way < SHMWAYS; way++) {
+		s = &set->slot[way];
+		if (s->used && s->hash == h && strncmp(s->path, f->path, SHMPATHLEN) == 0) {
+			atomic_fetch_add_explicit(&shm->invalidations, 1, memory_order_relaxed);
+			return way;
+		}
+	}
+
+	for (int way = 0; way < SHMWAYS; way++)
+		if (!set->slot[way].used)
+			return way;
+
+	for (;;) {
+		s = &set->slot[set->hand];
+		set->hand = (set->hand + 1) % SHMWAYS;
+		if (atomic_exchange_explicit(&s->referenced, 0, memory_order_relaxed) == 0) {
+			atomic_fetch_add_explicit(&shm->evictions, 1, memory_order_relaxed);
+			return s - set->slot;
+		}
+	}
+}
+
+
+static void store (struct shmSet *set, const struct cachedFile *f, unsigned h, const char *content) {
+	struct shmSlot *s;
+	unsigned seq;
+	int way;
+
+	if (!lock_writer())
+		return;		/* Another process is storing, a later miss will store this file */
+
+	way = victim(set, f, h);
+	s = &set->slot[way];
+
+	seq = atomic_load_explicit(&s->seq, memory_order_relaxed) | 1;	/* Already odd if the previous writer has died here */
+	atomic_store_explicit(&s->seq, seq, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);	/* Readers see the odd number before any change */
+
+	s->used = 1;
+	s->hash = h;
+	s->size = f->size;
+	s->mtime = f->mtime;
+	s->dev = f->dev;
+	s->ino = f->ino;
+	strcpy(s->path, f->path);
+	memcpy(slot_data(set, way), content, f->size);
+	atomic_store_explicit(&s->referenced, 0, memory_order_relaxed);
+
+	atomic_store_explicit(&s->seq, seq + 1, memory_order_release);
+	atomic_store_explicit(&shm->writer, 0, memory_order_release);
+}
+
+
+/* Maps the segment, budget bytes of content at most. Must be called before forking.
+ * Returns 0 on success, -1 if the budget is too small for one set or the segment can not be mapped */
+
+int shmCacheInit (size_t budget) {
+	size_t sets = 1, size;
+	void *p;
+
+	if (budget / MAXCONTENTSIZE < SHMWAYS)
+		return -1;
+	while (sets * 2 * SHMWAYS <= budget / MAXCONTENTSIZE)
+		sets <<= 1;
+
+	size = sizeof(struct shmHeader) + sets * sizeof(struct shmSet);
+	size = (size + MAXCONTENTSIZE - 1) / MAXCONTENTSIZE * MAXCONTENTSIZE;	/* Content is page aligned */
+
+	p = mmap(NULL, size + sets * SHMWAYS * MAXCONTENTSIZE, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);	/* Zero filled, pages are allocated when first written */
+	if (p == MAP_FAILED)
+		return -1;
+
+	shm = p;
+	shm->setMask = sets - 1;
+	data = (char *)p + size;
+	return 0;
+}
+
+
+/* Returns the content of f copied into buf (at least MAXCONTENTSIZE bytes), from the segment or read from the file
+ * and stored for the other processes. NULL if f is too big or can not be read */
+
+char *shmCacheContent (const struct cachedFile *f, char *buf) {
+	struct shmSet *set;
+	unsigned h;
+
+	if (shm == NULL || f->size > MAXCONTENTSIZE || strlen(f->path) >= SHMPATHLEN)
+		return NULL;
+
+	h = hash_path(f->path);
+	set = &shm->set[h & shm->setMask];
+
+	for (int way = 0; way < SHMWAYS; way++)
+		if (read_slot(set, way, f, h, buf)) {
+			atomic_fetch_add_explicit(&shm->hits, 1, memory_order_relaxed);
+			return buf;
+		}
+
+	atomic_fetch_add_explicit(&shm->misses, 1, memory_order_relaxed);
+
+	if (pread(f->fd, buf, f->size, 0) != f->size)
+		return NULL;
+
+	store(set, f, h, buf);
+	return buf;
+}
+
+
+/* Counters of all the processes. bytes and files are read without synchronization and may be slightly off */
+
+void shmCacheStats (struct cacheStats *st) {
+	memset(st, 0, sizeof(*st));
+	if (shm == NULL)
+		return;
+
+	st->hits = atomic_load_explicit(&shm->hits, memory_order_relaxed);
+	st->misses = atomic_load_explicit(&shm->misses, memory_order_relaxed);
+	st->evictions = atomic_load_explicit(&shm->evictions, memory_order_relaxed);
+	st->invalidations = atomic_load_explicit(&shm->invalidations, memory_order_relaxed);
+
+	for (unsigned i = 0; i <= shm->setMask; i++)
+		for (int way = 0; way < SHMWAYS; way++)
+			if (shm->set[i].slot[way].used) {
+				st->bytes += shm->set[i].slot[way].size;
+				st->files++;
+			}
+}
@@ -0,0 +1,34 @@
+/*
+
+module: shmcache.h
+
+purpose: definitions of functions in shmcache.c
+
+*/
+
+#ifndef _SHMCACHE_H
+
+#define _SHMCACHE_H
+
+#include <sys/types.h>
+
+#include "filecache.h"
+
+#define SHMPATHLEN	256	/* Longer paths are never kept in the shared cache */
+#define SHMWAYS		8	/* Slots of each set, a path can only be stored in the set given by its hash */
+
+/* Content of small files shared by processes forked after shmCacheInit(), each slot holds at most MAXCONTENTSIZE
+ * bytes. Readers take no lock: every slot has a sequence number, odd while it is being written, and a read is
+ * valid only if the number is even and unchanged after the content has been copied. Only one process writes at a
+ * time, a miss is not stored if another process is writing.
+ * Entries are found by path and checked against the size, last modification and inode of the file opened by
+ * the caller (through the file cache of its process), so a changed file is never served and its entry is
+ * replaced by the next miss. */
+
+int shmCacheInit (size_t budget);
+
+char *shmCacheContent (const struct cachedFile *f, char *buf);
+
+void shmCacheStats (struct cacheStats *st);
+
+#endif
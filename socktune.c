@@ -0,0 +1,207 @@
+/*
+
+module: socktune.c
+
+purpose: socket options by profile (LAN, WAN, small-file latency) and send/receive buffers sized
+	 to the bandwidth-delay product measured with TCP_INFO during the first part of a transfer.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>		/* struct tcp_info with tcpi_delivery_rate, newer than the glibc one */
+
+#include "errlib.h"
+#include "socktune.h"
+
+const struct tuneProfile tuneProfiles[] = {
+	/* name		initialBuf	maxBuf		bdpFactor	nodelay	notsentLowat */
+	{ "lan",	0,		16*1024*1024,	2,		0,	0 },
+	{ "wan",	16*1024*1024,	128*1024*1024,	2,		0,	128*1024 },	/* Big window scale, short unsent queue */
+	{ "latency",	0,		1024*1024,	1,		1,	16*1024 },	/* Small responses leave at once */
+	{ NULL }
+};
+
+
+static double now (void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* Third value of tcp_wmem or tcp_rmem: the size autotuning can reach without any setsockopt() */
+
+static long autotuneMax (int sending) {
+	static long max[2];
+	FILE *f;
+	long lo, def;
+
+	if (max[sending] == 0) {
+		max[sending] = -1;
+		if ((f = fopen(sending ? "/proc/sys/net/ipv4/tcp_wmem" : "/proc/sys/net/ipv4/tcp_rmem", "r")) != NULL) {
+			if (fscanf(f, "%ld %ld %ld", &lo, &def, &max[sending]) != 3)
+				max[sending] = -1;
+			fclose(f);
+		}
+	}
+	return max[sending];
+}
+
+
+/* Sets the buffer to size bytes (the kernel doubles the value it is given), beyond net.core.[rw]mem_max if allowed.
+ * Returns the size obtained */
+
+static int setBuffer (int fd, int sending, int size) {
+	int val = size / 2;
+	socklen_t len = sizeof(size);
+
+#ifdef SO_SNDBUFFORCE
+	if (setsockopt(fd, SOL_SOCKET, sending ? SO_SNDBUFFORCE : SO_RCVBUFFORCE, &val, sizeof(val)) != 0)
+#endif
+		setsockopt(fd, SOL_SOCKET, sending ? SO_SNDBUF : SO_RCVBUF, &val, sizeof(val));	/* Capped by [rw]mem_max */
+
+	if (getsockopt(fd, SOL_SOCKET, sending ? SO_SNDBUF : SO_RCVBUF, &size, &len) != 0)
+		return 0;
+	return size;
+}
+
+
+int tuneProfileByName (const char *name) {
+	for (int i = 0; tuneProfiles[i].name != NULL; i++)
+		if (strcmp(tuneProfiles[i].name, name) == 0)
+			return i;
+	return TUNE_NONE;
+}
+
+
+void tuneSocket (int fd, int profile) {
+	const struct tuneProfile *p;
+	int sndbuf = 0, rcvbuf = 0;
+
+	if (profile == TUNE_NONE)
+		return;
+	p = &tuneProfiles[profile];
+
+	if (p->initialBuf != 0) {
+		sndbuf = setBuffer(fd, 1, p->initialBuf);
+		rcvbuf = setBuffer(fd, 0, p->initialBuf);
+	}
+	if (p->nodelay)
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &p->nodelay, sizeof(p->nodelay));
+#ifdef TCP_NOTSENT_LOWAT
+	if (p->notsentLowat != 0)
+		setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &p->notsentLowat, sizeof(p->notsentLowat));
+#endif
+
+	err_msg("socket %d, profile %s: SO_SNDBUF %d, SO_RCVBUF %d (0: autotuning), TCP_NODELAY %d, TCP_NOTSENT_LOWAT %d",
+		fd, p->name, sndbuf, rcvbuf, p->nodelay, p->notsentLowat);
+}
+
+
+/* File content is sent corked: with a small TCP_NOTSENT_LOWAT each sendfile() would queue a few KB and wait for the
+ * cork timer (200 ms) before the next one, so a sender lifts it until tunerEnd() */
+
+void tunerInit (struct socketTuner *t, int fd, int profile, int sending) {
+	memset(t, 0, sizeof(*t));
+	t->profile = profile;
+	t->sending = sending;
+	t->nextSample = TUNE_FIRST_SAMPLE;
+	t->start = now();
+
+#ifdef TCP_NOTSENT_LOWAT
+	if (profile != TUNE_NONE && sending && tuneProfiles[profile].notsentLowat != 0) {
+		int unlimited = INT_MAX;
+
+		setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &unlimited, sizeof(unlimited));
+	}
+#endif
+}
+
+
+/* Restores the TCP_NOTSENT_LOWAT of the profile for the small responses that follow on the connection */
+
+void tunerEnd (struct socketTuner *t, int fd) {
+#ifdef TCP_NOTSENT_LOWAT
+	if (t->profile != TUNE_NONE && t->sending && tuneProfiles[t->profile].notsentLowat != 0)
+		setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &tuneProfiles[t->profile].notsentLowat, sizeof(int));
+#endif
+}
+
+
+/* Bytes that can be moved before the next sample, so that one sendfile() of a whole file does not skip them */
+
+size_t tunerLimit (const struct socketTuner *t) {
+	if (t->profile == TUNE_NONE || t->samples >= TUNE_SAMPLES)
+		return SIZE_MAX;
+	return t->nextSample - t->bytes;
+}
+
+
+/* Reads TCP_INFO and grows the buffer to bdpFactor times the bandwidth-delay product. The sender takes the delivery
+ * rate and rtt of the kernel (cwnd * mss if bigger), the receiver its own throughput and receive rtt. While the
+ * throughput is limited by the buffer, each sample doubles it (bdpFactor 2) */
+
+static void sample (struct socketTuner *t, int fd) {
+	const struct tuneProfile *p = &tuneProfiles[t->profile];
+	struct tcp_info ti;
+	socklen_t len = sizeof(ti);
+	double rtt, rate, bdp;
+	long target, limit;
+	int current;
+	socklen_t clen = sizeof(current);
+
+	memset(&ti, 0, sizeof(ti));
+	if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) != 0 ||
+	    getsockopt(fd, SOL_SOCKET, t->sending ? SO_SNDBUF : SO_RCVBUF, &current, &clen) != 0)
+		return;
+
+	if (t->sending) {
+		rtt = ti.tcpi_rtt / 1e6;
+		rate = ti.tcpi_delivery_rate;	/* Bytes/s, 0 before Linux 4.18 (field not returned) */
+		bdp = rate * rtt;
+		if ((double)ti.tcpi_snd_cwnd * ti.tcpi_snd_mss > bdp)
+			bdp = (double)ti.tcpi_snd_cwnd * ti.tcpi_snd_mss;
+	} else {
+		rtt = (ti.tcpi_rcv_rtt != 0 ? ti.tcpi_rcv_rtt : ti.tcpi_rtt) / 1e6;
+		rate = t->bytes / (now() - t->start);
+		bdp = rate * rtt;
+	}
+
+	target = p->bdpFactor * bdp;
+	if (target > p->maxBuf)
+		target = p->maxBuf;
+	limit = autotuneMax(t->sending);
+
+	if (target <= current || (p->initialBuf == 0 && limit > 0 && target <= limit)) {	/* Already enough, or autotuning will do it */
+		err_msg("socket %d, profile %s: rtt %.1f ms, rate %.1f MB/s, cwnd %u x %u, BDP %.0f KB, %s %d KB kept",
+			fd, p->name, rtt * 1e3, rate / 1e6, ti.tcpi_snd_cwnd, ti.tcpi_snd_mss, bdp / 1024,
+			t->sending ? "SO_SNDBUF" : "SO_RCVBUF", current / 1024);
+		return;
+	}
+
+	err_msg("socket %d, profile %s: rtt %.1f ms, rate %.1f MB/s, cwnd %u x %u, BDP %.0f KB, %s %d KB -> %d KB",
+		fd, p->name, rtt * 1e3, rate / 1e6, ti.tcpi_snd_cwnd, ti.tcpi_snd_mss, bdp / 1024,
+		t->sending ? "SO_SNDBUF" : "SO_RCVBUF", current / 1024, setBuffer(fd, t->sending, target) / 1024);
+}
+
+
+/* Called after each send()/recv()/sendfile() of n bytes of the transfer */
+
+void tunerUpdate (struct socketTuner *t, int fd, size_t n) {
+	t->bytes += n;
+
+	if (t->profile == TUNE_NONE || t->samples >= TUNE_SAMPLES || t->bytes < t->nextSample)
+		return;
+
+	sample(t, fd);
+	t->samples++;
+	t->nextSample *= 4;
+}
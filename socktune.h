@@ -0,0 +1,60 @@
+/*
+
+module: socktune.h
+
+purpose: definitions of functions in socktune.c
+
+*/
+
+#ifndef _SOCKTUNE_H
+
+#define _SOCKTUNE_H
+
+#include <sys/types.h>
+
+#define TUNE_NONE	-1	/* Sockets are left as the kernel creates them */
+#define TUNE_LAN	0
+#define TUNE_WAN	1
+#define TUNE_LATENCY	2
+
+#define TUNE_FIRST_SAMPLE	(256*1024)	/* TCP_INFO is read after this many bytes of a transfer, */
+#define TUNE_SAMPLES		3		/* then after 4 and 16 times as many */
+
+struct tuneProfile {
+	const char *name;
+	int	initialBuf;	/* SO_SNDBUF/SO_RCVBUF before connect()/listen() (it also decides the window scale), 0 to keep autotuning */
+	int	maxBuf;		/* Upper bound of the size computed from the bandwidth-delay product */
+	int	bdpFactor;	/* Buffers hold this many BDPs */
+	int	nodelay;	/* TCP_NODELAY */
+	int	notsentLowat;	/* TCP_NOTSENT_LOWAT, 0 to leave it unset */
+};
+
+struct socketTuner {		/* Measurement of one transfer */
+	int	profile;
+	int	sending;
+	int	samples;
+	off_t	bytes, nextSample;
+	double	start;
+};
+
+extern const struct tuneProfile tuneProfiles[];
+
+/* Profiles are looked up by name ("lan", "wan", "latency"). tuneSocket() applies the presets to a socket before
+ * connect() or listen(), accepted sockets inherit them from the listening one. During a transfer, tunerUpdate()
+ * reads TCP_INFO (rtt, cwnd, delivery rate) a few times and grows the send or receive buffer to bdpFactor times
+ * the measured bandwidth-delay product, if that is more than kernel autotuning can reach.
+ * The chosen values are logged with err_msg(). */
+
+int tuneProfileByName (const char *name);
+
+void tuneSocket (int fd, int profile);
+
+void tunerInit (struct socketTuner *t, int fd, int profile, int sending);
+
+size_t tunerLimit (const struct socketTuner *t);
+
+void tunerUpdate (struct socketTuner *t, int fd, size_t n);
+
+void tunerEnd (struct socketTuner *t, int fd);
+
+#endif
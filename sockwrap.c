@@ -17,6 +17,7 @@
 #include <sys/select.h>
 #include <sys/wait.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h> // TCP_CORK
 #include <arpa/inet.h> // inet_aton()
 #include <sys/un.h> // unix sockets
 #include <netdb.h>
@@ -25,6 +26,12 @@
 #include <string.h>
 #include <stdio.h>
 #include <inttypes.h> // SCNu16
+#include <poll.h>
+#include <time.h>
+#include <sys/ioctl.h> // FIONREAD, SIOCOUTQ
+#ifdef __linux__
+#include <linux/errqueue.h> // MSG_ZEROCOPY notifications
+#endif
 
 #include "errlib.h"
 #include "sockwrap.h"
@@ -445,6 +452,248 @@ void Sendn (int fd, void *ptr, size_t nbytes, int flags)
 		err_sys ("(%s) error - writen() failed", prog_name);
 }
 
+/* writev() of all the buffers, iov is modified.
+ * Returns the number of bytes written, -1 on error */
+
+ssize_t writevn (int fd, struct iovec *iov, int iovcnt)
+{
+	size_t total = 0;
+	ssize_t nwritten = 0;
+
+	for (;;)
+	{
+		while (iovcnt > 0 && (size_t)nwritten >= iov->iov_len) /* skip what has been written, and empty buffers */
+		{
+			nwritten -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt == 0)
+			return total;
+		iov->iov_base = (char *)iov->iov_base + nwritten;
+		iov->iov_len -= nwritten;
+
+		if ( (nwritten = writev(fd, iov, iovcnt)) <= 0)
+		{
+			if (INTERRUPTED_BY_SIGNAL)
+			{
+				nwritten = 0;
+				continue; /* and call writev() again */
+			}
+			else
+				return -1;
+		}
+		total += nwritten;
+	}
+}
+
+/* Reads the MSG_ZEROCOPY notifications waiting in the error queue of the socket.
+ * Returns the number of send() calls completed, -1 if the socket has failed */
+
+#ifdef SO_EE_ORIGIN_ZEROCOPY
+static long reapZerocopy (int fd)
+{
+	char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct sock_extended_err *serr;
+	long completed = 0;
+
+	for (;;)
+	{
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(fd, &msg, MSG_ERRQUEUE) == -1)
+			return (errno == EAGAIN || errno == EWOULDBLOCK || INTERRUPTED_BY_SIGNAL) ? completed : -1;
+
+		for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
+		{
+			if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+			      (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+				continue;
+			serr = (struct sock_extended_err *)CMSG_DATA(cm);
+			if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno != 0)
+				continue;
+			completed += serr->ee_data - serr->ee_info + 1;	/* Range of send() calls, numbered from 0 on each socket */
+		}
+	}
+}
+#endif
+
+/* send() of the whole buffer with MSG_ZEROCOPY: the pages are sent without being copied into the socket buffer.
+ * Returns when the kernel has released all of them (their data has been acknowledged), so the buffer may then
+ * be modified or unmapped. Plain send() if the socket does not support it.
+ * Returns n, -1 on error */
+
+ssize_t sendZerocopy (int fd, const void *vptr, size_t n)
+{
+#ifdef SO_EE_ORIGIN_ZEROCOPY
+	const char *ptr = vptr;
+	size_t nleft = n;
+	ssize_t nwritten;
+	long calls = 0, completed = 0, r;
+	int on = 1, blocked;
+	struct pollfd pfd;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) != 0)
+		return sendn(fd, vptr, n, 0);
+
+	pfd.fd = fd;
+	pfd.events = 0;		/* POLLERR is always reported, it means notifications are waiting */
+	pfd.revents = 0;
+
+	while (nleft > 0 || completed < calls)
+	{
+		blocked = nleft == 0;
+		if (nleft > 0)
+		{
+			if ( (nwritten = send(fd, ptr, nleft, MSG_ZEROCOPY)) > 0)
+			{
+				calls++;
+				nleft -= nwritten;
+				ptr   += nwritten;
+			}
+			else if (errno == ENOBUFS)	/* Too many notifications pending */
+				blocked = 1;
+			else if (!INTERRUPTED_BY_SIGNAL)
+				return -1;
+		}
+
+		if ( (r = reapZerocopy(fd)) < 0)
+			return -1;
+		if (r == 0 && (pfd.revents & (POLLERR | POLLHUP)))
+			return -1;	/* Woken by a socket error, not by a notification */
+		completed += r;
+		pfd.revents = 0;
+
+		if (blocked && r == 0 && poll(&pfd, 1, -1) < 0 && !INTERRUPTED_BY_SIGNAL)	/* Wait for the acknowledgements */
+			return -1;
+	}
+	return n;
+#else
+	return sendn(fd, vptr, n, 0);
+#endif
+}
+
+/* With on = 1 the socket only sends full segments, so that the parts of a response written by several calls
+ * (header, sendfile(), trailer) are coalesced. With on = 0 what is pending is sent at once, without waiting
+ * for the acknowledgements as Nagle's algorithm would (delayed ACK stall after a small last write).
+ * Returns 0, -1 on error (not a TCP socket: nothing to coalesce) */
+
+int tcpCork (int fd, int on)
+{
+#ifdef TCP_CORK
+	return setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+#else
+	return -1;
+#endif
+}
+
+static double chunkClock (void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* fixed is the chunk size chosen by the user (see parseChunkSize()), 0 to adapt it during the transfer */
+
+void chunkInit (struct chunkSizer *c, size_t fixed)
+{
+	memset(c, 0, sizeof(*c));
+	c->fixed = fixed;
+	c->size = fixed != 0 ? fixed : CHUNK_MIN;
+	c->ceiling = CHUNK_MAX;
+	c->start = chunkClock();
+}
+
+/* Page aligned buffer for the biggest chunk a transfer of length bytes can use, to be freed with free().
+ * A small file gets a buffer of its own size: the callers never move more than the bytes left in one call */
+
+void *chunkBuffer (struct chunkSizer *c, off_t length)
+{
+	size_t page = sysconf(_SC_PAGESIZE), size = c->fixed != 0 ? c->fixed : CHUNK_MAX;
+	void *buf;
+
+	if (length < (off_t)size)
+		size = length > 0 ? (length + page - 1) / page * page : page;
+
+	if (posix_memalign(&buf, page, size) != 0)
+		return NULL;
+	return buf;
+}
+
+/* Called after each recv()/send() of n bytes on fd. Every CHUNK_PERIOD calls, the chunk doubles if all of them have
+ * been full and the socket could have given (or taken) more: data waiting to be read when receiving, room for
+ * two chunks in the send buffer when sending. It is halved, and never grows again, if the throughput has dropped
+ * since the last increase */
+
+void chunkUpdate (struct chunkSizer *c, int fd, size_t n, int sending)
+{
+	double t, rate;
+	int queued = 0, sndbuf = 0;
+	socklen_t len = sizeof(sndbuf);
+
+	c->bytes += n;
+	if (n == c->size)
+		c->full++;
+	if (c->fixed != 0 || ++c->calls < CHUNK_PERIOD)
+		return;
+
+	t = chunkClock();
+	rate = c->bytes / (t - c->start > 1e-9 ? t - c->start : 1e-9);
+
+	if (c->grown && rate < c->lastRate * 0.9)
+	{
+		c->size /= 2;
+		c->ceiling = c->size;
+	}
+	else if (c->full == c->calls && c->size < c->ceiling)
+	{
+		if (sending ? (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len) == 0 && (size_t)sndbuf >= 2 * c->size)
+			    : (ioctl(fd, FIONREAD, &queued) == 0 && (size_t)queued >= c->size))
+		{
+			c->size *= 2;
+			c->grown = 1;
+		}
+	}
+	else
+		c->grown = 0;
+
+	c->lastRate = rate;
+	c->bytes = 0;
+	c->calls = 0;
+	c->full = 0;
+	c->start = t;
+}
+
+/* "auto" or a number of bytes with an optional k or m suffix, rounded up to a page multiple within [page, CHUNK_MAX].
+ * Returns the value for chunkInit() (0 for auto), (size_t)-1 if arg is not valid */
+
+size_t parseChunkSize (const char *arg)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	char *end;
+	unsigned long long n;
+
+	if (strcmp(arg, "auto") == 0)
+		return 0;
+
+	n = strtoull(arg, &end, 10);
+	if (*end == 'k' || *end == 'K')
+		n *= 1024, end++;
+	else if (*end == 'm' || *end == 'M')
+		n *= 1024 * 1024, end++;
+	if (end == arg || *end != '\0' || n == 0)
+		return (size_t)-1;
+
+	n = (n + page - 1) / page * page;
+	return n > CHUNK_MAX ? CHUNK_MAX : n;
+}
+
 int Select (int maxfdp1, fd_set *readset, fd_set *writeset, fd_set *exceptset, struct timeval *timeout)
 {
 	int n;
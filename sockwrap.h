@@ -19,11 +19,26 @@
 #include <stdio.h>
 #include <signal.h>
 #include <unistd.h>
+#include <sys/uio.h>
 
 #define SA struct sockaddr
 
 #define INTERRUPTED_BY_SIGNAL (errno == EINTR)
 
+#define CHUNK_MIN	(64*1024)		/* First size of an adaptive chunk, a page multiple */
+#define CHUNK_MAX	(4*1024*1024)		/* Biggest chunk */
+#define CHUNK_PERIOD	8			/* Calls between two decisions */
+
+struct chunkSizer {				/* Bytes moved by each recv()/send() of a file transfer */
+	size_t	size;		/* Current chunk size */
+	size_t	fixed;		/* Chosen by the user, 0 if adaptive */
+	size_t	ceiling;	/* Growing beyond it has made the transfer slower */
+	int	grown;		/* The last decision was an increase */
+	int	calls, full;	/* Calls of this period, and those that used the whole chunk */
+	size_t	bytes;
+	double	start, lastRate;
+};
+
 typedef	void	Sigfunc(int);	/* for signal handlers */
 
 int Socket (int family, int type, int protocol);
@@ -82,6 +97,20 @@ ssize_t sendn (int fd, const void *vptr, size_t n, int flags);
 
 void Sendn (int fd, void *ptr, size_t nbytes, int flags);
 
+ssize_t writevn (int fd, struct iovec *iov, int iovcnt);
+
+ssize_t sendZerocopy (int fd, const void *vptr, size_t n);
+
+int tcpCork (int fd, int on);
+
+void chunkInit (struct chunkSizer *c, size_t fixed);
+
+void *chunkBuffer (struct chunkSizer *c, off_t length);
+
+void chunkUpdate (struct chunkSizer *c, int fd, size_t n, int sending);
+
+size_t parseChunkSize (const char *arg);
+
 int Select (int maxfdp1, fd_set *readset, fd_set *writeset, fd_set *exceptset, struct timeval *timeout);
 
 pid_t Fork (void);
@@ -0,0 +1,100 @@
+/*
+
+module: trace.c
+
+purpose: per-process ring of fixed size records marking the phases of each connection, kept in a file
+	 for bench/trace_report.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "trace.h"
+
+#define RING_SIZE (sizeof(struct traceHeader) + TRACE_RECORDS * sizeof(struct traceRecord))
+
+static const char *phaseNames[TRACE_PHASES] = {
+	"none", "connected", "wait_request", "request", "wait_writable", "open",
+	"send_header", "first_byte", "body", "drain", "idle", "close"
+};
+
+static struct traceHeader *ring;		/* NULL: tracing off */
+static struct traceRecord *records;
+
+
+int traceInit (const char *prefix, const char *name) {
+	char path[4096];
+	const char *base;
+	void *p;
+	int fd;
+
+	if (ring != NULL) {			/* Inherited from the parent */
+		munmap(ring, RING_SIZE);
+		ring = NULL;
+	}
+
+	snprintf(path, sizeof(path), "%s.%d", prefix, (int)getpid());
+	if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+		return -1;
+	if (ftruncate(fd, RING_SIZE) != 0) {
+		close(fd);
+		return -1;
+	}
+	p = mmap(NULL, RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);	/* Zero filled: no phase set */
+	close(fd);
+	if (p == MAP_FAILED)
+		return -1;
+
+	ring = p;
+	records = (struct traceRecord *)(ring + 1);
+
+	base = strrchr(name, '/') != NULL ? strrchr(name, '/') + 1 : name;
+	memcpy(ring->magic, TRACE_MAGIC, sizeof(ring->magic));
+	ring->recordSize = sizeof(struct traceRecord);
+	ring->records = TRACE_RECORDS;
+	ring->pid = getpid();
+	snprintf(ring->name, sizeof(ring->name), "%s", base);
+	return 0;
+}
+
+
+/* Identifier of the connection on socket, unique among the live connections of the host: the pid of the process
+ * that accepted or opened it, and the descriptor. A descriptor reused later starts with TRACE_CONNECT again */
+
+uint64_t traceConnection (int socket) {
+	return (uint64_t)getpid() << 32 | (uint32_t)socket;
+}
+
+
+void traceEvent (uint64_t conn, int phase, uint64_t bytes) {
+	struct traceRecord *r;
+	struct timespec ts;
+	uint64_t i;
+
+	if (ring == NULL)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);	/* vDSO, no system call */
+
+	i = atomic_fetch_add_explicit(&ring->head, 1, memory_order_relaxed);
+	r = &records[i % TRACE_RECORDS];
+
+	atomic_store_explicit((_Atomic uint32_t *)&r->phase, TRACE_NONE, memory_order_relaxed);	/* Overwriting an old record */
+	r->ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	r->conn = conn;
+	r->bytes = bytes;
+	atomic_store_explicit((_Atomic uint32_t *)&r->phase, phase, memory_order_release);
+}
+
+
+const char *tracePhaseName (int phase) {
+	return phase >= 0 && phase < TRACE_PHASES ? phaseNames[phase] : "unknown";
+}
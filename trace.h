@@ -0,0 +1,68 @@
+/*
+
+module: trace.h
+
+purpose: definitions of functions in trace.c
+
+*/
+
+#ifndef _TRACE_H
+
+#define _TRACE_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+#define TRACE_MAGIC	"FTTRACE1"
+#define TRACE_RECORDS	(1 << 16)	/* Records kept by each process, older ones are overwritten */
+
+/* Each event starts a phase of a connection, which lasts until its next event */
+
+#define TRACE_NONE	0	/* Slot not written yet */
+#define TRACE_CONNECT	1	/* Connection accepted (server) or established (client) */
+#define TRACE_WAIT	2	/* Waiting for a request: select() in service(), bytes: part already received */
+#define TRACE_REQUEST	3	/* Request received (server) or sent (client), bytes: request length */
+#define TRACE_WAIT_SEND	4	/* Waiting for the socket to be writable */
+#define TRACE_OPEN	5	/* Looking up, opening and checking the file */
+#define TRACE_HEADER	6	/* Sending the header */
+#define TRACE_BODY	7	/* Content requested, until its first byte is sent (server) or received (client) */
+#define TRACE_FIRST_BYTE 8	/* bytes: those of the first send/sendfile/recv */
+#define TRACE_DRAIN	9	/* Content done, last modification and uncork, bytes: content length */
+#define TRACE_DONE	10	/* Response complete, bytes: content length */
+#define TRACE_CLOSE	11	/* Connection closed, ends the last phase */
+#define TRACE_PHASES	12
+
+struct traceRecord {		/* 32 bytes */
+	uint64_t ns;		/* CLOCK_MONOTONIC, the same clock in every process of the host */
+	uint64_t conn;		/* traceConnection() */
+	uint64_t bytes;
+	uint32_t phase;
+	uint32_t pad;
+};
+
+struct traceHeader {		/* At the start of each ring file, followed by TRACE_RECORDS records */
+	char	magic[8];
+	uint32_t recordSize;
+	uint32_t records;
+	uint32_t pid;
+	char	name[32];	/* Program */
+	uint32_t pad;
+	_Atomic uint64_t head;	/* Records written since the start, the next one goes to head % records */
+};
+
+/* traceInit() creates the ring of this process in "<prefix>.<pid>", a shared file mapping: records written by
+ * traceEvent() are in the file even if the process is killed, nothing has to be dumped. A process forked after
+ * traceInit() calls it again to get its own ring. Without traceInit() traceEvent() returns at once.
+ * Writers take a slot with one atomic increment, so threads of a process can trace at the same time; a record is
+ * valid once its phase is set. The rings of a client and of a server are read together by bench/trace_report. */
+
+int traceInit (const char *prefix, const char *name);
+
+uint64_t traceConnection (int socket);
+
+void traceEvent (uint64_t conn, int phase, uint64_t bytes);
+
+const char *tracePhaseName (int phase);
+
+#endif